@@ -4,10 +4,13 @@ class Node {
 public:
   int rowidx, colidx;
   Node *rowptr, *colptr;
+  double value = 0;
 
   Node();
   Node(int row, int col)
       : rowidx(row), colidx(col), rowptr(nullptr), colptr(nullptr) {}
+  Node(int row, int col, double v)
+      : rowidx(row), colidx(col), rowptr(nullptr), colptr(nullptr), value(v) {}
   Node(int row, int col, Node *rp, Node *colp)
       : rowidx(row), colidx(col), rowptr(rp), colptr(colp) {}
 };
@@ -1 +1,187 @@
 #include "SparseMatrix.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <thread>
+
+SparseMatrix::SparseMatrix(int rows, int columns,
+                           const std::vector<Node> &entries)
+    : row_len(rows), col_len(columns) {
+  if (rows < 0 || columns < 0) {
+    throw std::runtime_error("Matrix can't have a negative size");
+  }
+  for (const Node &e : entries) {
+    if (e.rowidx < 0 || e.rowidx >= rows || e.colidx < 0 ||
+        e.colidx >= columns) {
+      throw std::runtime_error("Entry out of range of the matrix");
+    }
+  }
+
+  // counting sort by row, then sort each row by column and merge repeats
+  std::vector<int> start(static_cast<size_t>(rows) + 1, 0);
+  for (const Node &e : entries) {
+    start[static_cast<size_t>(e.rowidx) + 1]++;
+  }
+  for (size_t r = 0; r < static_cast<size_t>(rows); r++) {
+    start[r + 1] += start[r];
+  }
+  std::vector<int> next(start.begin(), start.end() - 1);
+  std::vector<int> order(entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    order[static_cast<size_t>(next[static_cast<size_t>(entries[i].rowidx)]++)] =
+        static_cast<int>(i);
+  }
+
+  row_start.assign(static_cast<size_t>(rows) + 1, 0);
+  cols.reserve(entries.size());
+  vals.reserve(entries.size());
+  for (size_t r = 0; r < static_cast<size_t>(rows); r++) {
+    auto first = order.begin() + start[r];
+    auto last = order.begin() + start[r + 1];
+    std::sort(first, last, [&](int a, int b) {
+      return entries[static_cast<size_t>(a)].colidx <
+             entries[static_cast<size_t>(b)].colidx;
+    });
+    for (auto it = first; it != last; ++it) {
+      const Node &e = entries[static_cast<size_t>(*it)];
+      if (static_cast<int>(cols.size()) > row_start[r] &&
+          cols.back() == e.colidx) {
+        vals.back() += e.value;
+      } else {
+        cols.push_back(e.colidx);
+        vals.push_back(e.value);
+      }
+    }
+    row_start[r + 1] = static_cast<int>(cols.size());
+  }
+}
+
+double SparseMatrix::at(int row, int col) const {
+  if (row < 0 || row >= row_len || col < 0 || col >= col_len) {
+    throw std::runtime_error("Index out of range of the matrix");
+  }
+  auto first = cols.begin() + row_start[static_cast<size_t>(row)];
+  auto last = cols.begin() + row_start[static_cast<size_t>(row) + 1];
+  auto it = std::lower_bound(first, last, col);
+  if (it == last || *it != col) {
+    return 0;
+  }
+  return vals[static_cast<size_t>(it - cols.begin())];
+}
+
+std::vector<double> SparseMatrix::row_sums() const {
+  std::vector<double> sums(static_cast<size_t>(row_len), 0);
+  for (size_t r = 0; r < sums.size(); r++) {
+    for (int i = row_start[r]; i < row_start[r + 1]; i++) {
+      sums[r] += vals[static_cast<size_t>(i)];
+    }
+  }
+  return sums;
+}
+
+SparseMatrix SparseMatrix::transpose() const {
+  std::vector<Node> entries;
+  entries.reserve(vals.size());
+  for (int r = 0; r < row_len; r++) {
+    for (int i = row_start[static_cast<size_t>(r)];
+         i < row_start[static_cast<size_t>(r) + 1]; i++) {
+      entries.emplace_back(cols[static_cast<size_t>(i)], r,
+                           vals[static_cast<size_t>(i)]);
+    }
+  }
+  return SparseMatrix(col_len, row_len, entries);
+}
+
+std::vector<double> SparseMatrix::multiply(const std::vector<double> &x,
+                                           int threads) const {
+  if (static_cast<int>(x.size()) != col_len) {
+    throw std::runtime_error("Vector doesn't match the matrix");
+  }
+  std::vector<double> y(static_cast<size_t>(row_len), 0);
+  auto rows_from = [&](int lo, int hi) {
+    for (int r = lo; r < hi; r++) {
+      double sum = 0;
+      for (int i = row_start[static_cast<size_t>(r)];
+           i < row_start[static_cast<size_t>(r) + 1]; i++) {
+        sum += vals[static_cast<size_t>(i)] *
+               x[static_cast<size_t>(cols[static_cast<size_t>(i)])];
+      }
+      y[static_cast<size_t>(r)] = sum;
+    }
+  };
+
+  // small products aren't worth starting threads for
+  if (threads <= 1 || nonzeros() < 1 << 14) {
+    rows_from(0, row_len);
+    return y;
+  }
+  // thread t gets the rows holding entries t / threads to (t + 1) / threads
+  std::vector<std::thread> workers;
+  int lo = 0;
+  for (int t = 1; t <= threads; t++) {
+    int hi = row_len;
+    if (t < threads) {
+      long long want = static_cast<long long>(nonzeros()) * t / threads;
+      hi = static_cast<int>(std::lower_bound(row_start.begin(), row_start.end(),
+                                             want) -
+                            row_start.begin());
+      hi = std::clamp(hi, lo, row_len);
+    }
+    workers.emplace_back(rows_from, lo, hi);
+    lo = hi;
+  }
+  for (std::thread &w : workers) {
+    w.join();
+  }
+  return y;
+}
+
+std::vector<double> SparseMatrix::propagate(std::vector<double> x, int k,
+                                            int threads) const {
+  if (row_len != col_len) {
+    throw std::runtime_error("A markov chain has to be square");
+  }
+  // x P is P^T x, and P^T x splits into rows nicely
+  SparseMatrix back = transpose();
+  for (int step = 0; step < k; step++) {
+    x = back.multiply(x, threads);
+  }
+  return x;
+}
+
+std::vector<double> SparseMatrix::stationary(int threads, double tolerance,
+                                             int max_steps) const {
+  if (row_len != col_len) {
+    throw std::runtime_error("A markov chain has to be square");
+  }
+  if (row_len == 0) {
+    return {};
+  }
+  SparseMatrix back = transpose();
+  const double n = static_cast<double>(row_len);
+  std::vector<double> x(static_cast<size_t>(row_len), 1 / n);
+
+  for (int step = 0; step < max_steps; step++) {
+    std::vector<double> y = back.multiply(x, threads);
+    double kept = 0;
+    for (double v : y) {
+      kept += v;
+    }
+    double spread = (1 - kept) / n;
+    double moved = 0;
+    for (size_t i = 0; i < y.size(); i++) {
+      // half a step each time. the stationary distribution is the same but
+      // a chain that goes around in cycles can't keep power iteration from
+      // settling
+      y[i] = (x[i] + y[i] + spread) / 2;
+      moved += std::fabs(y[i] - x[i]);
+    }
+    x.swap(y);
+    if (moved < tolerance) {
+      break;
+    }
+  }
+  return x;
+}
@@ -1,5 +1,43 @@
 #pragma once
 
+#include "Node.h"
+#include <vector>
+
+// compressed sparse row storage. the entries of row r are at
+// row_start[r] .. row_start[r + 1] - 1 in cols and vals, sorted by column
 class SparseMatrix {
   int row_len, col_len;
+  std::vector<int> row_start;
+  std::vector<int> cols;
+  std::vector<double> vals;
+
+public:
+  // entries can come in any order, ones on the same row and column add up.
+  // only rowidx, colidx and value of each node are used, not the links
+  SparseMatrix(int rows, int columns, const std::vector<Node> &entries);
+
+  int rows() const { return row_len; }
+  int columns() const { return col_len; }
+  int nonzeros() const { return static_cast<int>(vals.size()); }
+  double at(int row, int col) const;
+  std::vector<double> row_sums() const;
+  SparseMatrix transpose() const;
+
+  // A x, with the rows split between threads so each gets about the same
+  // number of entries
+  std::vector<double> multiply(const std::vector<double> &x, int threads) const;
+
+  // the rest treats the matrix as a markov chain, row r being where state r
+  // goes next. a row can add up to less than 1, the rest of its mass is lost
+
+  // x P^k, where a walk that starts out distributed like x is after k steps.
+  // whatever it adds up to less than x did was lost on the way
+  std::vector<double> propagate(std::vector<double> x, int k,
+                                int threads) const;
+  // the distribution x = x P by power iteration, starting from uniform. mass
+  // lost from a row is spread over every state again, like a walk that
+  // restarts anywhere once it gets stuck. stops once a step moves less than
+  // tolerance in total
+  std::vector<double> stationary(int threads, double tolerance = 1e-12,
+                                 int max_steps = 10000) const;
 };
@@ -1,263 +1,2798 @@
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include <map>
+#include <memory>
+#include <optional>
+#include <span>
 #include <stdexcept>
 #include <variant>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__x86_64__) && defined(__linux__)
+#define HAVE_JIT 1
+#include <sys/mman.h>
+#else
+#define HAVE_JIT 0
+#endif
+
 // Forward declarations
 struct ParseTree;
 class Interpreter;
 
-// Represents the different data types our language can handle.
-// Using std::variant for a type-safe union.
-using ValueVariant = std::variant<std::monostate, bool, int, double, std::string>;
+// --- Output ---
+// Where print goes. Output collects in a buffer that's written to the stream
+// when it fills up, on flush() and when the sink goes away, rather than the
+// stream being flushed after every print.
+class OutputSink {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+    explicit OutputSink(std::ostream& out = std::cout, size_t capacity = DEFAULT_CAPACITY)
+        : out(&out), capacity(std::max<size_t>(capacity, 64)), buffer(new char[this->capacity]) {}
+    ~OutputSink() { flush(); }
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+
+    void write(std::string_view text) {
+        if (text.size() > capacity - used) {
+            drain();
+            if (text.size() > capacity) {
+                out->write(text.data(), static_cast<std::streamsize>(text.size()));
+                return;
+            }
+        }
+        std::memcpy(buffer.get() + used, text.data(), text.size());
+        used += text.size();
+    }
+
+    void write(char c) {
+        if (used == capacity) drain();
+        buffer[used++] = c;
+    }
+
+    void write(int value) {
+        if (capacity - used < 16) drain();
+        used = std::to_chars(buffer.get() + used, buffer.get() + capacity, value).ptr - buffer.get();
+    }
+
+    // The way an ostream writes it by default: %g with 6 significant digits
+    void write(double value) {
+        if (capacity - used < 32) drain();
+        used = std::to_chars(buffer.get() + used, buffer.get() + capacity, value,
+                             std::chars_format::general, 6).ptr - buffer.get();
+    }
+
+    // Writes out everything so far and flushes the stream
+    void flush() {
+        drain();
+        out->flush();
+    }
+
+private:
+    std::ostream* out;
+    size_t capacity;
+    std::unique_ptr<char[]> buffer;
+    size_t used = 0;
+
+    void drain() {
+        out->write(buffer.get(), static_cast<std::streamsize>(used));
+        used = 0;
+    }
+};
+
+// Represents the different data types our language can handle: a type tag and
+// a union, 16 bytes in all. A string Value is the first `length` characters of
+// a heap buffer shared by every Value made from it, so copying one is a
+// reference count bump. Characters already in a buffer never change, so a Value
+// ending at the end of its buffer can have more appended for the next Value to
+// use (see concat). Counts aren't atomic, a program runs on one thread.
+struct StringObject {
+    size_t refs;
+    std::string text;
+};
+
+struct Value {
+    enum Type : uint8_t { NIL, BOOL, INT, DOUBLE, STRING };
+
+    Type type;
+    uint32_t length = 0; // STRING only
+    union {
+        bool boolean;
+        int integer;
+        double real;
+        StringObject* str;
+    };
+
+    Value() : type(NIL), integer(0) {}
+    Value(bool val) : type(BOOL), boolean(val) {}
+    Value(int val) : type(INT), integer(val) {}
+    Value(double val) : type(DOUBLE), real(val) {}
+    Value(const std::string& val) : Value(std::string(val)) {}
+    Value(std::string&& val) : type(STRING), length(checked_length(val.size())),
+                               str(new StringObject{1, std::move(val)}) {}
+    Value(const char* val) : Value(std::string(val)) {}
+
+    Value(const Value& other) : type(other.type), length(other.length), real(other.real) {
+        if (type == STRING) ++str->refs;
+    }
+    Value(Value&& other) noexcept : type(other.type), length(other.length), real(other.real) {
+        other.type = NIL;
+    }
+    Value& operator=(const Value& other) {
+        if (other.type == STRING) ++other.str->refs;
+        release();
+        type = other.type;
+        length = other.length;
+        real = other.real;
+        return *this;
+    }
+    Value& operator=(Value&& other) noexcept {
+        if (this != &other) {
+            release();
+            type = other.type;
+            length = other.length;
+            real = other.real;
+            other.type = NIL;
+        }
+        return *this;
+    }
+    ~Value() { release(); }
+
+    // Overwrite in place, cheaper than assigning a whole new Value
+    void set(bool val) { release(); type = BOOL; boolean = val; }
+    void set(int val) { release(); type = INT; integer = val; }
+    void set(double val) { release(); type = DOUBLE; real = val; }
+
+    // Only valid when type is STRING. Good until the next concat
+    std::string_view text() const { return std::string_view(str->text.data(), length); }
+
+    // Helper to print the value
+    void print(OutputSink& out) const {
+        switch (type) {
+            case NIL: out.write("null"); break;
+            case BOOL: out.write(boolean ? "true" : "false"); break;
+            case INT: out.write(integer); break;
+            case DOUBLE: out.write(real); break;
+            case STRING: out.write(text()); break;
+        }
+    }
+
+    bool is_number() const {
+        return type == INT || type == DOUBLE;
+    }
+
+    // Only valid when is_number()
+    double as_double() const {
+        return type == INT ? integer : real;
+    }
+
+    // Helper to check for truthiness (like in Python)
+    bool is_truthy() const {
+        switch (type) {
+            case BOOL: return boolean;
+            case INT: return integer != 0;
+            case DOUBLE: return real != 0.0;
+            case STRING: return length != 0;
+            default: return false;
+        }
+    }
+
+    // Same type and same value. Values of different types are never equal,
+    // 1 == 1.0 included
+    bool operator==(const Value& other) const {
+        if (type != other.type) return false;
+        switch (type) {
+            case BOOL: return boolean == other.boolean;
+            case INT: return integer == other.integer;
+            case DOUBLE: return real == other.real;
+            case STRING:
+                return length == other.length && (str == other.str || text() == other.text());
+            default: return true;
+        }
+    }
+
+    // String concatenation. Both must be strings. When left reaches the end of
+    // its buffer the characters of right go on the end of that buffer, which
+    // `s = s + piece` in a loop always finds, so building a string that way
+    // takes time linear in its length.
+    static Value concat(const Value& left, const Value& right) {
+        uint32_t size = checked_length(size_t(left.length) + right.length);
+        std::string& buffer = left.str->text;
+        if (buffer.size() == left.length) {
+            buffer.append(right.text());
+            Value result(left);
+            result.length = size;
+            return result;
+        }
+        std::string text;
+        text.reserve(size);
+        text.append(left.text());
+        text.append(right.text());
+        return Value(std::move(text));
+    }
+
+private:
+    static uint32_t checked_length(size_t size) {
+        if (size > UINT32_MAX) throw std::runtime_error("Runtime Error: String too long.");
+        return static_cast<uint32_t>(size);
+    }
+
+    void release() {
+        if (type == STRING && --str->refs == 0) delete str;
+    }
+};
+
+static_assert(sizeof(Value) == 16);
+
+// --- Operators ---
+// What the binary and unary operators do, shared by the tree walker, the
+// constant folder and the VM. The ConstantFolder decodes each operator node's
+// text into ParseTree::op once, before running.
+enum class Operator : uint8_t {
+    ADD, SUB, MUL, DIV, GT, LT, GE, LE, EQ, NE, // binary
+    NEG, NOT,                                   // unary
+    UNKNOWN
+};
+
+Operator binary_operator(std::string_view text) {
+    static const std::map<std::string, Operator, std::less<>> ops = {
+        {"+", Operator::ADD}, {"-", Operator::SUB}, {"*", Operator::MUL}, {"/", Operator::DIV},
+        {">", Operator::GT}, {"<", Operator::LT}, {">=", Operator::GE}, {"<=", Operator::LE},
+        {"==", Operator::EQ}, {"!=", Operator::NE}};
+    auto it = ops.find(text);
+    return it == ops.end() ? Operator::UNKNOWN : it->second;
+}
+
+Operator unary_operator(std::string_view text) {
+    if (text == "-") return Operator::NEG;
+    if (text == "!") return Operator::NOT;
+    return Operator::UNKNOWN;
+}
+
+// int op int. Only called with binary operators
+inline Value int_operation(Operator op, int l, int r) {
+    switch (op) {
+        case Operator::ADD: return Value(l + r);
+        case Operator::SUB: return Value(l - r);
+        case Operator::MUL: return Value(l * r);
+        case Operator::DIV: return Value(l / r);
+        case Operator::GT: return Value(l > r);
+        case Operator::LT: return Value(l < r);
+        case Operator::GE: return Value(l >= r);
+        case Operator::LE: return Value(l <= r);
+        case Operator::EQ: return Value(l == r);
+        case Operator::NE: return Value(l != r);
+        default: throw std::runtime_error("Runtime Error: Invalid binary operation between types.");
+    }
+}
+
+// double op double. Only called with binary operators
+inline Value double_operation(Operator op, double l, double r) {
+    switch (op) {
+        case Operator::ADD: return Value(l + r);
+        case Operator::SUB: return Value(l - r);
+        case Operator::MUL: return Value(l * r);
+        case Operator::DIV: return Value(l / r);
+        case Operator::GT: return Value(l > r);
+        case Operator::LT: return Value(l < r);
+        case Operator::GE: return Value(l >= r);
+        case Operator::LE: return Value(l <= r);
+        case Operator::EQ: return Value(l == r);
+        case Operator::NE: return Value(l != r);
+        default: throw std::runtime_error("Runtime Error: Invalid binary operation between types.");
+    }
+}
+
+Value binary_operation(Operator op, const Value& left, const Value& right) {
+    // Equality operators (can work on mixed types)
+    if (op == Operator::EQ) return Value(left == right);
+    if (op == Operator::NE) return Value(!(left == right));
+
+    // Numeric operations
+    if (left.type == Value::INT && right.type == Value::INT) {
+        return int_operation(op, left.integer, right.integer);
+    }
+
+    // Promote int to double if mixing types
+    if (left.is_number() && right.is_number()) {
+        return double_operation(op, left.as_double(), right.as_double());
+    }
+
+    // String Concatenation
+    if (op == Operator::ADD && left.type == Value::STRING && right.type == Value::STRING) {
+        return Value::concat(left, right);
+    }
+
+    throw std::runtime_error("Runtime Error: Invalid binary operation between types.");
+}
+
+// text is the operator as written, for the error
+Value unary_operation(Operator op, std::string_view text, const Value& right) {
+    if (op == Operator::NEG) {
+        if (right.type == Value::INT) return Value(-right.integer);
+        if (right.type == Value::DOUBLE) return Value(-right.real);
+    } else if (op == Operator::NOT) {
+         return Value(!right.is_truthy());
+    }
+    throw std::runtime_error("Runtime Error: Invalid unary operator '" + std::string(text) + "'.");
+}
+
+// Represents a node in the Parse Tree (Abstract Syntax Tree)
+enum class NodeType : uint8_t {
+    PROGRAM,
+    BLOCK,
+    ASSIGNMENT,
+    IF_STATEMENT,
+    WHILE_LOOP,
+    FUNCTION_CALL,
+    BINARY_OP,
+    UNARY_OP,
+    VARIABLE,
+    INT_LITERAL,
+    DOUBLE_LITERAL,
+    STRING_LITERAL,
+    BOOL_LITERAL
+};
+
+// How the tree walker evaluates a BINARY_OP site. Each one starts UNSEEN and
+// settles on a path for the operand types it meets first (INT for int op int,
+// DOUBLE for double op double, STRING for string + string). If the types ever
+// change it drops to GENERIC for good.
+enum class Specialization : uint8_t { UNSEEN, INT, DOUBLE, STRING, GENERIC };
+
+struct ParseTree {
+    NodeType type;
+    std::string value; // Stores operator, variable name, literal value
+    std::vector<ParseTree*> children;
+
+    ParseTree(NodeType t, std::string val = "") : type(t), value(val) {}
+
+    // Destructor to clean up child nodes. Goes through them with a worklist
+    // rather than recursion, so a deep tree can't overflow the stack.
+    ~ParseTree() {
+        std::vector<ParseTree*> pending = std::move(children);
+        while (!pending.empty()) {
+            ParseTree* node = pending.back();
+            pending.pop_back();
+            if (!node) continue;
+            pending.insert(pending.end(), node->children.begin(), node->children.end());
+            node->children.clear();
+            delete node;
+        }
+    }
+};
+
+// --- Flat AST ---
+// What actually runs: the whole tree in one array of nodes, each naming its
+// children through a range of 32-bit indices in `edges`, with every node's text
+// in the one `strings` buffer. A program is three allocations however big it
+// is, and freeing it is three more. Nodes are stored children first, and are
+// never added or moved once the program has been built.
+//
+// Equal texts are stored once, so two nodes name the same identifier exactly
+// when their `text` offsets match.
+struct Ast {
+    static constexpr uint32_t NONE = UINT32_MAX; // a missing child
+
+    struct Node {
+        NodeType type;
+        // Filled in by the ConstantFolder: for BINARY_OP and UNARY_OP nodes
+        // their operator, and for any node the index of its value in the
+        // folder's constants if that's known before running.
+        Operator op = Operator::UNKNOWN;
+        Specialization specialization = Specialization::UNSEEN;
+        int32_t constant = -1;
+        uint32_t text = 0, text_size = 0;             // in strings
+        uint32_t first_child = 0, num_children = 0;   // in edges
+        uint32_t line = 0;                            // in the source, when parsed
+        // Filled in by the Resolver. VARIABLE and ASSIGNMENT nodes get the
+        // variable they use, found in slot `slot` of the frame at `depth`, or
+        // else the index of their DynamicBinding. Blocks get their BlockInfo.
+        int32_t var = -1;
+        int32_t depth = -1;
+        int32_t slot = -1;
+        int32_t dynamic = -1;
+        int32_t block = -1;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> edges;
+    std::string strings;
+    uint32_t root = NONE;
+
+    // Where each distinct text starts in strings
+    struct TextHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view text) const { return std::hash<std::string_view>()(text); }
+    };
+    std::unordered_map<std::string, uint32_t, TextHash, std::equal_to<>> text_index;
+
+    Ast() = default;
+
+    // Flattens tree, which is left as it is
+    explicit Ast(const ParseTree* tree) {
+        if (!tree) return;
+        // Size everything up front so each array is allocated once
+        size_t num_nodes = 0, num_edges = 0, num_chars = 0;
+        std::vector<const ParseTree*> pending = {tree};
+        while (!pending.empty()) {
+            const ParseTree* node = pending.back();
+            pending.pop_back();
+            ++num_nodes;
+            num_edges += node->children.size();
+            num_chars += node->value.size();
+            for (const ParseTree* child : node->children) {
+                if (child) pending.push_back(child);
+            }
+        }
+        nodes.reserve(num_nodes);
+        edges.reserve(num_edges);
+        strings.reserve(num_chars);
+
+        // Children before parents: `done` holds the ids of the finished
+        // children of every node on the stack, in order
+        struct Frame {
+            const ParseTree* tree;
+            size_t next_child;
+        };
+        std::vector<Frame> stack = {{tree, 0}};
+        std::vector<uint32_t> done;
+        while (!stack.empty()) {
+            Frame& top = stack.back();
+            if (top.next_child < top.tree->children.size()) {
+                const ParseTree* child = top.tree->children[top.next_child++];
+                if (child) {
+                    stack.push_back({child, 0});
+                } else {
+                    done.push_back(NONE);
+                }
+                continue;
+            }
+            size_t n = top.tree->children.size();
+            uint32_t id = add(top.tree->type, top.tree->value, std::span(done).last(n));
+            done.resize(done.size() - n);
+            done.push_back(id);
+            stack.pop_back();
+        }
+        root = done.back();
+    }
+
+    // Appends a node whose children have already been added
+    uint32_t add(NodeType type, std::string_view text, std::span<const uint32_t> children,
+                 uint32_t line = 0) {
+        Node node;
+        node.type = type;
+        node.line = line;
+        node.text = intern(text);
+        node.text_size = static_cast<uint32_t>(text.size());
+        node.first_child = static_cast<uint32_t>(edges.size());
+        node.num_children = static_cast<uint32_t>(children.size());
+        edges.insert(edges.end(), children.begin(), children.end());
+        nodes.push_back(node);
+        return static_cast<uint32_t>(nodes.size()) - 1;
+    }
+
+    uint32_t intern(std::string_view text) {
+        if (text.empty()) return 0;
+        auto it = text_index.find(text);
+        if (it != text_index.end()) return it->second;
+        uint32_t offset = static_cast<uint32_t>(strings.size());
+        strings.append(text);
+        text_index.emplace(text, offset);
+        return offset;
+    }
+
+    Node* node(uint32_t id) { return id == NONE ? nullptr : &nodes[id]; }
+    Node* child(const Node* parent, size_t i) { return node(edges[parent->first_child + i]); }
+    std::string_view text(const Node* node) const {
+        return std::string_view(strings).substr(node->text, node->text_size);
+    }
+};
+
+// --- Lexer ---
+// Turns source text into tokens one at a time, as the parser asks for them.
+// Tokens point into the source rather than copying it. Whitespace and
+// identifiers, most of any script, are scanned 16 bytes at a time with SSE2
+// where it's available.
+struct Token {
+    enum Kind : uint8_t {
+        IDENT, INT, DOUBLE, STRING, IF, ELSE, WHILE, TRUE, FALSE,
+        LPAREN, RPAREN, LBRACE, RBRACE, COMMA, SEMICOLON, ASSIGN,
+        PLUS, MINUS, STAR, SLASH, BANG, EQ, NE, LT, GT, LE, GE,
+        END
+    };
+    Kind kind = END;
+    std::string_view text; // STRING: between the quotes, still escaped
+    int line = 1;
+    bool escaped = false;  // STRING: has a backslash in it
+};
+
+class Lexer {
+public:
+    explicit Lexer(std::string_view source) : src(source) {}
+
+    Token next() {
+        skip_space();
+        Token token;
+        token.line = line;
+        if (pos >= src.size()) return token;
+        size_t start = pos;
+        char c = src[pos];
+        if (is_ident_start(c)) {
+            pos = scan_ident(pos + 1);
+            token.text = src.substr(start, pos - start);
+            token.kind = keyword(token.text);
+            return token;
+        }
+        if (is_digit(c)) return number(token);
+        if (c == '"') return string(token);
+        ++pos;
+        token.text = src.substr(start, 1);
+        switch (c) {
+            case '(': token.kind = Token::LPAREN; break;
+            case ')': token.kind = Token::RPAREN; break;
+            case '{': token.kind = Token::LBRACE; break;
+            case '}': token.kind = Token::RBRACE; break;
+            case ',': token.kind = Token::COMMA; break;
+            case ';': token.kind = Token::SEMICOLON; break;
+            case '+': token.kind = Token::PLUS; break;
+            case '-': token.kind = Token::MINUS; break;
+            case '*': token.kind = Token::STAR; break;
+            case '/': token.kind = Token::SLASH; break;
+            case '=': token.kind = follow('=') ? Token::EQ : Token::ASSIGN; break;
+            case '!': token.kind = follow('=') ? Token::NE : Token::BANG; break;
+            case '<': token.kind = follow('=') ? Token::LE : Token::LT; break;
+            case '>': token.kind = follow('=') ? Token::GE : Token::GT; break;
+            default:
+                throw std::runtime_error("Syntax Error: Unexpected character '" + std::string(1, c) +
+                                         "' on line " + std::to_string(line) + ".");
+        }
+        token.text = src.substr(start, pos - start);
+        return token;
+    }
+
+private:
+    std::string_view src;
+    size_t pos = 0;
+    int line = 1;
+
+    static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+    static bool is_ident_start(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+    static bool is_ident(char c) { return is_ident_start(c) || is_digit(c); }
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+    bool follow(char c) {
+        if (pos < src.size() && src[pos] == c) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+
+    // Skips whitespace and // comments, counting lines
+    void skip_space() {
+        for (;;) {
+#if defined(__SSE2__)
+            while (pos + 16 <= src.size()) {
+                __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src.data() + pos));
+                __m128i newline = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'));
+                __m128i space = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), newline),
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t')),
+                                 _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+                unsigned not_space = ~static_cast<unsigned>(_mm_movemask_epi8(space)) & 0xFFFF;
+                unsigned newlines = static_cast<unsigned>(_mm_movemask_epi8(newline));
+                if (not_space == 0) {
+                    line += std::popcount(newlines);
+                    pos += 16;
+                    continue;
+                }
+                int skip = std::countr_zero(not_space);
+                line += std::popcount(newlines & ((1u << skip) - 1));
+                pos += skip;
+                break;
+            }
+#endif
+            while (pos < src.size() && is_space(src[pos])) {
+                if (src[pos] == '\n') ++line;
+                ++pos;
+            }
+            if (pos + 1 < src.size() && src[pos] == '/' && src[pos + 1] == '/') {
+                size_t end = src.find('\n', pos);
+                pos = end == std::string_view::npos ? src.size() : end;
+                continue;
+            }
+            return;
+        }
+    }
+
+    // Returns the end of the identifier characters starting at i
+    size_t scan_ident(size_t i) const {
+#if defined(__SSE2__)
+        while (i + 16 <= src.size()) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src.data() + i));
+            // Letters either case once the 0x20 bit is set, then digits and '_'.
+            // Bytes above 0x7F are negative, so they fall outside every range
+            __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+            __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                           _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+            __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+                                          _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+            __m128i underscore = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_'));
+            unsigned ident = static_cast<unsigned>(
+                _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(letter, digit), underscore)));
+            if (ident != 0xFFFF) return i + std::countr_one(ident);
+            i += 16;
+        }
+#endif
+        while (i < src.size() && is_ident(src[i])) ++i;
+        return i;
+    }
+
+    static Token::Kind keyword(std::string_view word) {
+        switch (word.size()) {
+            case 2: if (word == "if") return Token::IF; break;
+            case 4:
+                if (word == "else") return Token::ELSE;
+                if (word == "true") return Token::TRUE;
+                break;
+            case 5:
+                if (word == "while") return Token::WHILE;
+                if (word == "false") return Token::FALSE;
+                break;
+        }
+        return Token::IDENT;
+    }
+
+    Token number(Token& token) {
+        size_t start = pos;
+        while (pos < src.size() && is_digit(src[pos])) ++pos;
+        token.kind = Token::INT;
+        if (pos + 1 < src.size() && src[pos] == '.' && is_digit(src[pos + 1])) {
+            ++pos;
+            while (pos < src.size() && is_digit(src[pos])) ++pos;
+            token.kind = Token::DOUBLE;
+        }
+        token.text = src.substr(start, pos - start);
+        return token;
+    }
+
+    Token string(Token& token) {
+        size_t start = ++pos;
+        while (pos < src.size() && src[pos] != '"') {
+            if (src[pos] == '\\') {
+                token.escaped = true;
+                ++pos;
+            } else if (src[pos] == '\n') {
+                ++line;
+            }
+            ++pos;
+        }
+        if (pos >= src.size()) {
+            throw std::runtime_error("Syntax Error: Unterminated string on line " +
+                                     std::to_string(token.line) + ".");
+        }
+        token.kind = Token::STRING;
+        token.text = src.substr(start, pos - start);
+        ++pos;
+        return token;
+    }
+};
+
+// --- Parser ---
+// Recursive descent for statements and a Pratt parser for expressions, adding
+// nodes straight into an Ast as they complete. A node's children are always
+// finished before it is, which is the order the Ast wants.
+//
+//   program    := statement*
+//   statement  := block | 'if' '(' expr ')' statement ['else' statement]
+//               | 'while' '(' expr ')' statement | IDENT '=' expr ';'
+//               | IDENT '(' [expr {',' expr}] ')' ';'
+//   block      := '{' statement* '}'
+//
+// Binary operators from loosest to tightest are == !=, < > <= >=, + -, * /,
+// all left associative, then unary - and !.
+class Parser {
+public:
+    Ast parse(std::string_view source) {
+        Lexer lexer(source);
+        lex = &lexer;
+        ast = Ast();
+        // Typical scripts come to a node and an edge every 10 or so bytes, so
+        // this is usually the only allocation each array needs
+        ast.nodes.reserve(source.size() / 8);
+        ast.edges.reserve(source.size() / 8);
+        ast.strings.reserve(source.size() / 2);
+        advance();
+        size_t mark = pending.size();
+        while (token.kind != Token::END) pending.push_back(statement());
+        ast.root = finish(NodeType::PROGRAM, "", mark, 1);
+        return std::move(ast);
+    }
+
+private:
+    Lexer* lex = nullptr;
+    Ast ast;
+    Token token;                   // the next token, not consumed yet
+    std::vector<uint32_t> pending; // finished children of nodes still being parsed
+    std::string unescaped;
+
+    void advance() { token = lex->next(); }
+
+    [[noreturn]] void error(const std::string& expected) const {
+        std::string found = token.kind == Token::END ? "end of input" : "'" + std::string(token.text) + "'";
+        throw std::runtime_error("Syntax Error: Expected " + expected + " but found " + found +
+                                 " on line " + std::to_string(token.line) + ".");
+    }
+
+    void expect(Token::Kind kind, const char* what) {
+        if (token.kind != kind) error(what);
+        advance();
+    }
+
+    // Adds a node whose children are everything pending after mark
+    uint32_t finish(NodeType type, std::string_view text, size_t mark, int line) {
+        uint32_t id = ast.add(type, text, std::span(pending).subspan(mark), line);
+        pending.resize(mark);
+        return id;
+    }
+
+    uint32_t leaf(NodeType type, std::string_view text, int line) {
+        return ast.add(type, text, {}, line);
+    }
+
+    uint32_t statement() {
+        size_t mark = pending.size();
+        int line = token.line;
+        switch (token.kind) {
+            case Token::LBRACE: {
+                advance();
+                while (token.kind != Token::RBRACE) {
+                    if (token.kind == Token::END) error("'}'");
+                    pending.push_back(statement());
+                }
+                advance();
+                return finish(NodeType::BLOCK, "", mark, line);
+            }
+            case Token::IF: {
+                advance();
+                pending.push_back(condition());
+                pending.push_back(statement());
+                if (token.kind == Token::ELSE) {
+                    advance();
+                    pending.push_back(statement());
+                }
+                return finish(NodeType::IF_STATEMENT, "", mark, line);
+            }
+            case Token::WHILE: {
+                advance();
+                pending.push_back(condition());
+                pending.push_back(statement());
+                return finish(NodeType::WHILE_LOOP, "", mark, line);
+            }
+            case Token::IDENT: {
+                Token name = token;
+                advance();
+                uint32_t id;
+                if (token.kind == Token::ASSIGN) {
+                    advance();
+                    pending.push_back(leaf(NodeType::VARIABLE, name.text, line));
+                    pending.push_back(expression(0));
+                    id = finish(NodeType::ASSIGNMENT, "", mark, line);
+                } else if (token.kind == Token::LPAREN) {
+                    id = call(name);
+                } else {
+                    error("'=' or '('");
+                }
+                expect(Token::SEMICOLON, "';'");
+                return id;
+            }
+            default:
+                error("a statement");
+        }
+    }
+
+    uint32_t condition() {
+        expect(Token::LPAREN, "'('");
+        uint32_t id = expression(0);
+        expect(Token::RPAREN, "')'");
+        return id;
+    }
+
+    // token is the '(' after name
+    uint32_t call(const Token& name) {
+        size_t mark = pending.size();
+        advance();
+        if (token.kind != Token::RPAREN) {
+            pending.push_back(expression(0));
+            while (token.kind == Token::COMMA) {
+                advance();
+                pending.push_back(expression(0));
+            }
+        }
+        expect(Token::RPAREN, "')'");
+        return finish(NodeType::FUNCTION_CALL, name.text, mark, name.line);
+    }
+
+    static int precedence(Token::Kind kind) {
+        switch (kind) {
+            case Token::EQ: case Token::NE: return 1;
+            case Token::LT: case Token::GT: case Token::LE: case Token::GE: return 2;
+            case Token::PLUS: case Token::MINUS: return 3;
+            case Token::STAR: case Token::SLASH: return 4;
+            default: return 0;
+        }
+    }
+    static constexpr int UNARY = 5;
+
+    // Parses operators binding tighter than min_precedence
+    uint32_t expression(int min_precedence) {
+        uint32_t left = prefix();
+        for (;;) {
+            int p = precedence(token.kind);
+            if (p <= min_precedence) return left;
+            std::string_view op = token.text;
+            int line = token.line;
+            advance();
+            size_t mark = pending.size();
+            pending.push_back(left);
+            pending.push_back(expression(p));
+            left = finish(NodeType::BINARY_OP, op, mark, line);
+        }
+    }
+
+    uint32_t prefix() {
+        Token t = token;
+        switch (t.kind) {
+            case Token::INT: advance(); return leaf(NodeType::INT_LITERAL, t.text, t.line);
+            case Token::DOUBLE: advance(); return leaf(NodeType::DOUBLE_LITERAL, t.text, t.line);
+            case Token::TRUE: case Token::FALSE: advance(); return leaf(NodeType::BOOL_LITERAL, t.text, t.line);
+            case Token::STRING:
+                advance();
+                return leaf(NodeType::STRING_LITERAL, t.escaped ? unescape(t.text) : t.text, t.line);
+            case Token::IDENT:
+                advance();
+                if (token.kind == Token::LPAREN) return call(t);
+                return leaf(NodeType::VARIABLE, t.text, t.line);
+            case Token::MINUS: case Token::BANG: {
+                advance();
+                size_t mark = pending.size();
+                pending.push_back(expression(UNARY));
+                return finish(NodeType::UNARY_OP, t.text, mark, t.line);
+            }
+            case Token::LPAREN: {
+                advance();
+                uint32_t id = expression(0);
+                expect(Token::RPAREN, "')'");
+                return id;
+            }
+            default:
+                error("an expression");
+        }
+    }
+
+    // \n, \t, and a backslash before anything else stands for that character
+    std::string_view unescape(std::string_view text) {
+        unescaped.clear();
+        for (size_t i = 0; i < text.size(); ++i) {
+            char c = text[i];
+            if (c == '\\' && i + 1 < text.size()) {
+                c = text[++i];
+                if (c == 'n') c = '\n';
+                if (c == 't') c = '\t';
+            }
+            unescaped += c;
+        }
+        return unescaped;
+    }
+};
+
+// --- Variable Resolution ---
+// An assignment sets the variable in the nearest scope that already has it, and
+// otherwise defines it in the innermost one, so which scope a name lives in can
+// depend on what ran before. Most uses are decided ahead of time anyway: once a
+// block has certainly set a variable, every use after that (in it or in blocks
+// inside it) goes there. The rest keep the list of blocks it could be in and
+// check which ones are set when they run. The answers are written into the
+// VARIABLE and ASSIGNMENT nodes themselves (see Ast::Node).
+
+// A use that can't be decided ahead of time
+struct DynamicBinding {
+    std::string name;
+    std::vector<int> candidates; // innermost first. A write that finds none of
+                                 // them set defines the first one
+};
+
+// Every block gets its own variables, numbered across the whole program. There
+// are no user functions, so a block is never active twice at the same time.
+//
+// A name assigned in a block only gets a variable there if some use can end up
+// in it. In `while (x > 5) { x = x - 1; }` the x set before the loop always
+// wins, so the loop body keeps nothing and runs without a frame of its own.
+struct BlockInfo {
+    int depth = 0; // the program block is 0
+    int parent = -1;
+    int first_var = 0;
+    std::vector<std::string> names; // names[i] is variable first_var + i, in
+                                    // slot i of the block's frame
+    std::vector<uint32_t> symbols;  // and symbols[i] its interned Ast text
+};
+
+class Resolver {
+public:
+    std::vector<BlockInfo> blocks;
+    std::vector<std::string> var_names;
+    std::vector<int> var_block;
+    // Variables that appear in some DynamicBinding. Whether they are set has to
+    // be tracked while running, everything else is always set before it's read.
+    std::vector<bool> checked;
+    std::vector<DynamicBinding> dynamic;
+    // The most slots the frames of the blocks active at one time can need, and
+    // the deepest block
+    size_t max_slots = 0;
+    int max_depth = 0;
+
+    void resolve(Ast& program) {
+        ast = &program;
+        visit_statement(ast->node(ast->root));
+        drop_unused();
+    }
+
+    int depth_of(int var) const { return blocks[var_block[var]].depth; }
+    int slot_of(int var) const { return var - blocks[var_block[var]].first_var; }
+
+private:
+    Ast* ast = nullptr;
+    std::vector<int> active;     // blocks being visited, innermost last
+    std::vector<bool> definite;  // variables certainly set at this point
+
+    int find_var(int block, uint32_t symbol) const {
+        const BlockInfo& info = blocks[block];
+        for (size_t i = 0; i < info.symbols.size(); ++i) {
+            if (info.symbols[i] == symbol) return info.first_var + static_cast<int>(i);
+        }
+        return -1;
+    }
+
+    // Collects every name assigned in block's own scope. Bodies of ifs and
+    // whiles that aren't blocks themselves run in the enclosing scope.
+    void declare(int block, const Ast::Node* node) {
+        if (!node) return;
+        switch (node->type) {
+            case NodeType::ASSIGNMENT: {
+                const Ast::Node* name = ast->child(node, 0);
+                if (find_var(block, name->text) < 0) {
+                    blocks[block].names.emplace_back(ast->text(name));
+                    blocks[block].symbols.push_back(name->text);
+                }
+                break;
+            }
+            case NodeType::IF_STATEMENT:
+                for (size_t i = 1; i < node->num_children; ++i) declare(block, ast->child(node, i));
+                break;
+            case NodeType::WHILE_LOOP:
+                declare(block, ast->child(node, 1));
+                break;
+            default:
+                break;
+        }
+    }
+
+    // name is the VARIABLE node naming what node uses (node itself for a read)
+    void bind(Ast::Node* node, const Ast::Node* name, bool write) {
+        node->var = node->depth = node->slot = node->dynamic = -1;
+        std::vector<int> candidates;
+        for (auto it = active.rbegin(); it != active.rend(); ++it) {
+            int var = find_var(*it, name->text);
+            if (var < 0) continue;
+            if (definite[var]) {
+                node->var = var;
+                break;
+            }
+            candidates.push_back(var);
+        }
+        // A write with nothing further out can only define its own variable
+        if (node->var < 0 && write && candidates.size() == 1) node->var = candidates[0];
+        if (node->var >= 0) {
+            node->depth = depth_of(node->var);
+            node->slot = slot_of(node->var);
+            return;
+        }
+        for (int var : candidates) checked[var] = true;
+        node->dynamic = static_cast<int>(dynamic.size());
+        dynamic.push_back({std::string(ast->text(name)), std::move(candidates)});
+    }
+
+    // Removes the variables no use binds to and renumbers the rest, then
+    // sizes the frames
+    void drop_unused() {
+        std::vector<bool> used(var_names.size(), false);
+        for (const Ast::Node& node : ast->nodes) {
+            if ((node.type == NodeType::VARIABLE || node.type == NodeType::ASSIGNMENT) && node.var >= 0) {
+                used[node.var] = true;
+            }
+        }
+        for (const DynamicBinding& binding : dynamic) {
+            for (int var : binding.candidates) used[var] = true;
+        }
+
+        std::vector<int> renumber(var_names.size(), -1);
+        std::vector<std::string> kept_names;
+        std::vector<int> kept_block;
+        std::vector<bool> kept_checked;
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            BlockInfo& info = blocks[b];
+            std::vector<std::string> names;
+            std::vector<uint32_t> symbols;
+            int first = static_cast<int>(kept_names.size());
+            for (size_t i = 0; i < info.names.size(); ++i) {
+                int var = info.first_var + static_cast<int>(i);
+                if (!used[var]) continue;
+                renumber[var] = static_cast<int>(kept_names.size());
+                kept_names.push_back(info.names[i]);
+                kept_block.push_back(static_cast<int>(b));
+                kept_checked.push_back(checked[var]);
+                names.push_back(info.names[i]);
+                symbols.push_back(info.symbols[i]);
+            }
+            info.first_var = first;
+            info.names = std::move(names);
+            info.symbols = std::move(symbols);
+        }
+        var_names = std::move(kept_names);
+        var_block = std::move(kept_block);
+        checked = std::move(kept_checked);
+
+        for (Ast::Node& node : ast->nodes) {
+            if ((node.type == NodeType::VARIABLE || node.type == NodeType::ASSIGNMENT) && node.var >= 0) {
+                node.var = renumber[node.var];
+                node.slot = slot_of(node.var);
+            }
+        }
+        for (DynamicBinding& binding : dynamic) {
+            for (int& var : binding.candidates) var = renumber[var];
+        }
+
+        // A block's parent is always numbered before it
+        std::vector<size_t> slots_through(blocks.size());
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            const BlockInfo& info = blocks[b];
+            slots_through[b] = info.names.size() + (info.parent < 0 ? 0 : slots_through[info.parent]);
+            max_slots = std::max(max_slots, slots_through[b]);
+            max_depth = std::max(max_depth, info.depth);
+        }
+    }
+
+    void visit_expression(Ast::Node* node) {
+        if (!node) return;
+        if (node->type == NodeType::VARIABLE) {
+            bind(node, node, false);
+            return;
+        }
+        if (node->type == NodeType::BINARY_OP || node->type == NodeType::UNARY_OP ||
+            node->type == NodeType::FUNCTION_CALL) {
+            for (size_t i = 0; i < node->num_children; ++i) visit_expression(ast->child(node, i));
+        }
+    }
+
+    void visit_statement(Ast::Node* node) {
+        if (!node) return;
+        switch (node->type) {
+            case NodeType::PROGRAM:
+            case NodeType::BLOCK: {
+                int id = static_cast<int>(blocks.size());
+                blocks.emplace_back();
+                blocks[id].depth = static_cast<int>(active.size());
+                blocks[id].parent = active.empty() ? -1 : active.back();
+                blocks[id].first_var = static_cast<int>(var_names.size());
+                node->block = id;
+                for (size_t i = 0; i < node->num_children; ++i) declare(id, ast->child(node, i));
+                for (const std::string& name : blocks[id].names) {
+                    var_names.push_back(name);
+                    var_block.push_back(id);
+                }
+                checked.resize(var_names.size(), false);
+                definite.resize(var_names.size(), false);
+
+                active.push_back(id);
+                for (size_t i = 0; i < node->num_children; ++i) {
+                    Ast::Node* statement = ast->child(node, i);
+                    visit_statement(statement);
+                    // A plain assignment in this block sets its variable for
+                    // good, unless it could have gone to another block
+                    if (statement && statement->type == NodeType::ASSIGNMENT && statement->var >= 0) {
+                        definite[statement->var] = true;
+                    }
+                }
+                active.pop_back();
+                for (size_t i = 0; i < blocks[id].names.size(); ++i) {
+                    definite[blocks[id].first_var + i] = false;
+                }
+                break;
+            }
+            case NodeType::ASSIGNMENT:
+                visit_expression(ast->child(node, 1));
+                bind(node, ast->child(node, 0), true);
+                break;
+            case NodeType::IF_STATEMENT:
+                visit_expression(ast->child(node, 0));
+                for (size_t i = 1; i < node->num_children; ++i) visit_statement(ast->child(node, i));
+                break;
+            case NodeType::WHILE_LOOP:
+                visit_expression(ast->child(node, 0));
+                visit_statement(ast->child(node, 1));
+                break;
+            case NodeType::FUNCTION_CALL:
+                visit_expression(node);
+                break;
+            default:
+                break;
+        }
+    }
+};
+
+// --- Constant Folding ---
+// Literals and operators are decoded once, and operators whose operands are all
+// constant are worked out, before the program runs. Every distinct constant is kept once in
+// `constants` and the nodes that evaluate to it point there (Ast::Node::constant).
+class ConstantFolder {
+public:
+    std::vector<Value> constants;
+
+    // Children come before their parents in the Ast, so one pass in order
+    // sees every operand before the operator using it
+    void fold(Ast& ast) {
+        for (Ast::Node& node : ast.nodes) fold(ast, &node);
+    }
+
+private:
+    // Doubles are keyed by their bits, so -0.0 and NaN get entries of their own
+    using Key = std::variant<std::monostate, bool, int, uint64_t, std::string>;
+    std::map<Key, int> index;
+
+    void fold(Ast& ast, Ast::Node* node) {
+        node->constant = -1;
+        node->specialization = Specialization::UNSEEN;
+        std::string_view text = ast.text(node);
+        switch (node->type) {
+            case NodeType::INT_LITERAL:
+                node->constant = intern(Value(parse_literal<int>(text)));
+                break;
+            case NodeType::DOUBLE_LITERAL:
+                node->constant = intern(Value(parse_literal<double>(text)));
+                break;
+            case NodeType::STRING_LITERAL:
+                node->constant = intern(Value(std::string(text)));
+                break;
+            case NodeType::BOOL_LITERAL:
+                node->constant = intern(Value(text == "true"));
+                break;
+            case NodeType::BINARY_OP: {
+                node->op = binary_operator(text);
+                const Ast::Node* left = ast.child(node, 0);
+                const Ast::Node* right = ast.child(node, 1);
+                if (left->constant < 0 || right->constant < 0) break;
+                const Value& l = constants[left->constant];
+                const Value& r = constants[right->constant];
+                // Integer division that traps is left to do so when it runs
+                if (node->op == Operator::DIV && l.type == Value::INT && r.type == Value::INT &&
+                    (r.integer == 0 || (r.integer == -1 && l.integer == INT32_MIN))) {
+                    break;
+                }
+                try {
+                    node->constant = intern(binary_operation(node->op, l, r));
+                } catch (const std::runtime_error&) {
+                    // Not valid for these types, which is reported when it runs
+                }
+                break;
+            }
+            case NodeType::UNARY_OP: {
+                node->op = unary_operator(text);
+                const Ast::Node* operand = ast.child(node, 0);
+                if (operand->constant < 0) break;
+                try {
+                    node->constant = intern(unary_operation(node->op, text, constants[operand->constant]));
+                } catch (const std::runtime_error&) {
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    template <typename T>
+    static T parse_literal(std::string_view text) {
+        std::string s(text);
+        try {
+            if constexpr (std::is_same_v<T, int>) return std::stoi(s);
+            else return std::stod(s);
+        } catch (const std::logic_error&) {
+            throw std::runtime_error("Interpreter Error: Invalid literal '" + s + "'.");
+        }
+    }
+
+    int intern(const Value& value) {
+        Key key;
+        switch (value.type) {
+            case Value::BOOL: key = value.boolean; break;
+            case Value::INT: key = value.integer; break;
+            case Value::DOUBLE: key = std::bit_cast<uint64_t>(value.real); break;
+            case Value::STRING: key = std::string(value.text()); break;
+            default: break;
+        }
+        auto [it, inserted] = index.emplace(std::move(key), static_cast<int>(constants.size()));
+        if (inserted) constants.push_back(value);
+        return it->second;
+    }
+};
+
+// --- Baseline JIT ---
+// While loops that get hot and mostly do int arithmetic are compiled to
+// x86-64, by the tree walker and the VM alike. The code works on the Values in
+// the stack or the registers where they are, so nothing is copied in or out. A
+// variable's position only depends on where its block is in the program, so
+// it can be baked into the code.
+//
+// Types are checked each time the code is entered: everything the loop reads
+// has to hold an int already and nothing it writes may hold a string (it
+// would never be released). Statements the compiler can't handle, like a
+// print or an assignment of a double, and divisions that would trap, leave the
+// code at the start of their statement. The tree walker or the VM finishes
+// that iteration and the next one goes back in through the guards.
+#if HAVE_JIT
+
+// Executable memory holding the code for one loop
+class NativeCode {
+public:
+    // nullptr if the memory can't be had
+    static std::unique_ptr<NativeCode> map(const std::vector<uint8_t>& bytes) {
+        void* memory = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return nullptr;
+        std::memcpy(memory, bytes.data(), bytes.size());
+        // Never writable and executable at the same time
+        if (mprotect(memory, bytes.size(), PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, bytes.size());
+            return nullptr;
+        }
+        return std::unique_ptr<NativeCode>(new NativeCode(memory, bytes.size()));
+    }
+
+    ~NativeCode() { munmap(memory, size); }
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+
+    // Runs the loop on the stack starting at base. 0 once the loop is done,
+    // otherwise 1 + the side exit it took.
+    uint32_t run(Value* base) const {
+        return reinterpret_cast<uint32_t (*)(Value*)>(memory)(base);
+    }
+
+private:
+    void* memory;
+    size_t size;
+
+    NativeCode(void* memory, size_t size) : memory(memory), size(size) {}
+};
+
+// Just the instructions the loop compiler needs. Values are addressed off rbx,
+// expressions are worked out in eax with ecx as the second operand.
+class Assembler {
+public:
+    enum Condition : uint8_t { E = 0x4, NE = 0x5, L = 0xC, GE = 0xD, LE = 0xE, G = 0xF };
+
+    // Where the right-hand side of an operation comes from
+    struct Operand {
+        enum Kind { IMMEDIATE, MEMORY, ECX } kind;
+        int32_t value = 0; // the immediate, or the displacement off rbx
+    };
+
+    std::vector<uint8_t> bytes;
+
+    size_t here() const { return bytes.size(); }
+
+    void prologue() {
+        emit({0x55, 0x48, 0x89, 0xE5, 0x53}); // push rbp; mov rbp, rsp; push rbx
+        emit({0x48, 0x89, 0xFB});             // mov rbx, rdi
+    }
+
+    // Returns eax. Also drops whatever an expression left pushed when it bailed.
+    void epilogue() {
+        emit({0x48, 0x8D, 0x65, 0xF8, 0x5B, 0x5D, 0xC3}); // lea rsp, [rbp-8]; pop rbx; pop rbp; ret
+    }
+
+    void load(int32_t disp) { memory(0x8B, 0, disp); }      // mov eax, [rbx+disp]
+    void store(int32_t disp) { memory(0x89, 0, disp); }     // mov [rbx+disp], eax
+    void store_byte(int32_t disp, uint8_t value) {          // mov byte [rbx+disp], value
+        memory(0xC6, 0, disp);
+        bytes.push_back(value);
+    }
+    void load_immediate(int32_t value) {                    // mov eax, value
+        bytes.push_back(0xB8);
+        imm32(value);
+    }
+
+    // ecx = operand
+    void to_ecx(const Operand& operand) {
+        if (operand.kind == Operand::IMMEDIATE) {
+            bytes.push_back(0xB9);
+            imm32(operand.value);
+        } else if (operand.kind == Operand::MEMORY) {
+            memory(0x8B, 1, operand.value);
+        }
+    }
+
+    void push() { bytes.push_back(0x50); }                  // push rax
+    void pop_under_ecx() { emit({0x89, 0xC1, 0x58}); }      // mov ecx, eax; pop rax
+
+    void add(const Operand& operand) { arithmetic(0x05, 0x03, {0x01, 0xC8}, operand); }
+    void sub(const Operand& operand) { arithmetic(0x2D, 0x2B, {0x29, 0xC8}, operand); }
+    void cmp(const Operand& operand) { arithmetic(0x3D, 0x3B, {0x39, 0xC8}, operand); }
+    void imul(const Operand& operand) {
+        if (operand.kind == Operand::IMMEDIATE) {
+            emit({0x69, 0xC0});                             // imul eax, eax, imm32
+            imm32(operand.value);
+        } else if (operand.kind == Operand::MEMORY) {
+            bytes.push_back(0x0F);
+            memory(0xAF, 0, operand.value);
+        } else {
+            emit({0x0F, 0xAF, 0xC1});
+        }
+    }
+    void neg() { emit({0xF7, 0xD8}); }
+    void idiv_ecx() { emit({0x99, 0xF7, 0xF9}); }           // cdq; idiv ecx
+    void test_eax() { emit({0x85, 0xC0}); }
+    void test_ecx() { emit({0x85, 0xC9}); }
+    void cmp_ecx_minus_one() { emit({0x83, 0xF9, 0xFF}); }
+
+    // Jumps whose target isn't known yet return where to patch it in.
+    // NO_JUMP stands for a jump that turned out not to be needed.
+    static constexpr size_t NO_JUMP = SIZE_MAX;
+
+    size_t jump() {
+        bytes.push_back(0xE9);
+        return rel32();
+    }
+    size_t jump_if(Condition condition) {
+        emit({0x0F, static_cast<uint8_t>(0x80 | condition)});
+        return rel32();
+    }
+    void jump_back(size_t target) { patch(jump(), target); }
+
+    void patch(size_t at, size_t target) {
+        if (at == NO_JUMP) return;
+        int32_t offset = static_cast<int32_t>(target) - static_cast<int32_t>(at + 4);
+        std::memcpy(&bytes[at], &offset, 4);
+    }
+
+    static Condition invert(Condition condition) { return static_cast<Condition>(condition ^ 1); }
+
+private:
+    void emit(std::initializer_list<uint8_t> list) { bytes.insert(bytes.end(), list); }
+
+    void imm32(int32_t value) {
+        uint8_t raw[4];
+        std::memcpy(raw, &value, 4);
+        bytes.insert(bytes.end(), raw, raw + 4);
+    }
+
+    size_t rel32() {
+        imm32(0);
+        return bytes.size() - 4;
+    }
+
+    // opcode with a [rbx+disp32] operand and reg in the middle of ModRM
+    void memory(uint8_t opcode, uint8_t reg, int32_t disp) {
+        bytes.push_back(opcode);
+        bytes.push_back(static_cast<uint8_t>(0x80 | reg << 3 | 3));
+        imm32(disp);
+    }
+
+    void arithmetic(uint8_t immediate, uint8_t from_memory, std::initializer_list<uint8_t> from_ecx,
+                    const Operand& operand) {
+        if (operand.kind == Operand::IMMEDIATE) {
+            bytes.push_back(immediate);                     // op eax, imm32
+            imm32(operand.value);
+        } else if (operand.kind == Operand::MEMORY) {
+            memory(from_memory, 0, operand.value);          // op eax, [rbx+disp]
+        } else {
+            emit(from_ecx);                                 // op eax, ecx
+        }
+    }
+};
+
+struct CompiledLoop {
+    // A variable the code touches, checked before going in
+    struct Slot {
+        size_t position; // in the stack
+        bool read = false;
+        bool checked = false; // has to be set already, the code doesn't set it
+    };
+
+    std::unique_ptr<NativeCode> code;
+    std::vector<Slot> slots;
+    // Where each side exit picks up: the nodes from the loop body down to the
+    // statement to run next. The first is the loop condition, with no path.
+    std::vector<std::vector<uint32_t>> exits;
+
+    // The guards. set is whether each position has been assigned.
+    bool can_enter(const Value* base, const std::vector<bool>& set) const {
+        for (const Slot& slot : slots) {
+            const Value& value = base[slot.position];
+            if (slot.checked && !set[slot.position]) return false;
+            if (value.type != Value::INT && (slot.read || value.type == Value::STRING)) return false;
+        }
+        return true;
+    }
+};
+
+// How far a loop has got towards running natively
+struct JitSite {
+    uint32_t iterations = 0;
+    bool rejected = false; // tried and can't be compiled
+    std::unique_ptr<CompiledLoop> loop;
+
+    // Counts an iteration. True once there have been threshold of them and
+    // the loop might still be compiled.
+    bool hot(uint32_t threshold) {
+        if (iterations < threshold) {
+            ++iterations;
+            return false;
+        }
+        return !rejected;
+    }
+};
+
+class LoopCompiler {
+public:
+    LoopCompiler(Ast& ast, const ConstantFolder& folder, const Resolver& resolver)
+        : ast(ast), folder(folder), resolver(resolver) {}
+
+    // Compiles the while loop at node for the tree walker, with frame and top
+    // as they are while it runs. nullptr if it can't be compiled or isn't
+    // worth it.
+    std::unique_ptr<CompiledLoop> compile(Ast::Node* node, const std::vector<size_t>& frame, size_t top) {
+        this->frame = &frame;
+        return compile(node, top);
+    }
+
+    // The same for the VM, where every variable is the register of its number
+    std::unique_ptr<CompiledLoop> compile(Ast::Node* node) {
+        frame = nullptr;
+        return compile(node, 0);
+    }
+
+private:
+    std::unique_ptr<CompiledLoop> compile(Ast::Node* node, size_t top) {
+        Ast::Node* condition = ast.child(node, 0);
+        Ast::Node* body = ast.child(node, 1);
+        if (!is_condition(condition) || !worth_entering(body)) return nullptr;
+
+        result = std::make_unique<CompiledLoop>();
+        result->exits.emplace_back();
+        next_frame = top;
+
+        masm.prologue();
+        size_t head = masm.here();
+        size_t done = jump_unless(condition, true);
+        statement(body);
+        masm.jump_back(head);
+        masm.patch(done, masm.here());
+        masm.load_immediate(0);
+        size_t out = masm.here();
+        masm.epilogue();
+
+        // Each side exit returns its number
+        std::vector<size_t> stubs(result->exits.size());
+        for (size_t i = 0; i < stubs.size(); ++i) {
+            stubs[i] = masm.here();
+            masm.load_immediate(static_cast<int32_t>(i + 1));
+            masm.jump_back(out);
+        }
+        for (auto [at, exit] : exit_jumps) masm.patch(at, stubs[exit]);
+
+        if (!ok) return nullptr;
+        result->code = NativeCode::map(masm.bytes);
+        if (!result->code) return nullptr;
+        return std::move(result);
+    }
+
+    Ast& ast;
+    const ConstantFolder& folder;
+    const Resolver& resolver;
+    const std::vector<size_t>* frame = nullptr; // none for registers
+    size_t next_frame = 0; // where the next block inside the loop puts its frame
+    Assembler masm;
+    std::unique_ptr<CompiledLoop> result;
+    bool ok = true;
+    std::vector<uint32_t> path;                        // down to the statement being compiled
+    std::unordered_map<uint32_t, size_t> exit_index;   // statement -> its side exit
+    std::unordered_map<size_t, size_t> slot_index;     // stack position -> its slot
+    std::vector<std::pair<size_t, size_t>> exit_jumps; // (where to patch, side exit)
+    std::vector<std::pair<int, size_t>> inner;         // depth and frame of the blocks with
+                                                       // variables inside the loop
+
+    uint32_t id(const Ast::Node* node) const { return static_cast<uint32_t>(node - ast.nodes.data()); }
+
+    const Value* constant(const Ast::Node* node) const {
+        return node->constant >= 0 ? &folder.constants[node->constant] : nullptr;
+    }
+
+    // --- What can be compiled ---
+    bool is_int_expression(Ast::Node* node) const {
+        if (const Value* value = constant(node)) return value->type == Value::INT;
+        switch (node->type) {
+            case NodeType::VARIABLE:
+                return node->var >= 0;
+            case NodeType::UNARY_OP:
+                return node->op == Operator::NEG && is_int_expression(ast.child(node, 0));
+            case NodeType::BINARY_OP:
+                return node->op <= Operator::DIV && is_int_expression(ast.child(node, 0)) &&
+                       is_int_expression(ast.child(node, 1));
+            default:
+                return false;
+        }
+    }
+
+    bool is_comparison(const Ast::Node* node) const {
+        return node->type == NodeType::BINARY_OP && node->constant < 0 &&
+               node->op >= Operator::GT && node->op <= Operator::NE;
+    }
+
+    bool is_condition(Ast::Node* node) const {
+        if (const Value* value = constant(node)) {
+            return value->type == Value::INT || value->type == Value::BOOL;
+        }
+        if (is_comparison(node)) {
+            return is_int_expression(ast.child(node, 0)) && is_int_expression(ast.child(node, 1));
+        }
+        if (node->type == NodeType::UNARY_OP && node->op == Operator::NOT) {
+            return is_condition(ast.child(node, 0));
+        }
+        return is_int_expression(node);
+    }
+
+    bool is_native(Ast::Node* node) const {
+        switch (node->type) {
+            case NodeType::ASSIGNMENT:
+                return node->var >= 0 && is_int_expression(ast.child(node, 1));
+            case NodeType::IF_STATEMENT:
+            case NodeType::WHILE_LOOP:
+                return is_condition(ast.child(node, 0));
+            case NodeType::BLOCK:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // A body that goes straight back out would only add the guards to every
+    // iteration
+    bool worth_entering(Ast::Node* body) const {
+        while (body->type == NodeType::BLOCK && body->num_children > 0) body = ast.child(body, 0);
+        return body->type != NodeType::BLOCK && is_native(body);
+    }
+
+    // --- Variables ---
+    CompiledLoop::Slot& slot(const Ast::Node* node) {
+        size_t position = node->var;
+        bool found = !frame;
+        for (auto it = inner.rbegin(); it != inner.rend() && !found; ++it) {
+            if (it->first == node->depth) {
+                position = it->second + node->slot;
+                found = true;
+                break;
+            }
+        }
+        if (!found) position = (*frame)[node->depth] + node->slot;
+        auto [it, inserted] = slot_index.try_emplace(position, result->slots.size());
+        if (inserted) {
+            result->slots.push_back({position});
+            result->slots.back().checked = resolver.checked[node->var];
+        }
+        return result->slots[it->second];
+    }
+
+    static int32_t integer_of(size_t position) {
+        return static_cast<int32_t>(position * sizeof(Value) + offsetof(Value, integer));
+    }
+    static int32_t type_of(size_t position) {
+        return static_cast<int32_t>(position * sizeof(Value) + offsetof(Value, type));
+    }
+
+    // --- Code ---
+    // The side exit to the start of the statement being compiled
+    size_t current_exit() {
+        if (path.empty()) return 0;
+        auto [it, inserted] = exit_index.try_emplace(path.back(), result->exits.size());
+        if (inserted) result->exits.push_back(path);
+        return it->second;
+    }
+
+    // Something simple enough to be the right-hand side of an instruction
+    std::optional<Assembler::Operand> operand(Ast::Node* node) {
+        if (const Value* value = constant(node)) return Assembler::Operand{Assembler::Operand::IMMEDIATE, value->integer};
+        if (node->type == NodeType::VARIABLE) {
+            CompiledLoop::Slot& variable = slot(node);
+            variable.read = true;
+            return Assembler::Operand{Assembler::Operand::MEMORY, integer_of(variable.position)};
+        }
+        return std::nullopt;
+    }
+
+    // eax = the left child, and the right child as an operand
+    Assembler::Operand operands(Ast::Node* node) {
+        expression(ast.child(node, 0));
+        Ast::Node* right = ast.child(node, 1);
+        if (auto simple = operand(right)) return *simple;
+        masm.push();
+        expression(right);
+        masm.pop_under_ecx();
+        return {Assembler::Operand::ECX};
+    }
+
+    // eax = node
+    void expression(Ast::Node* node) {
+        if (auto simple = operand(node)) {
+            if (simple->kind == Assembler::Operand::IMMEDIATE) masm.load_immediate(simple->value);
+            else masm.load(simple->value);
+            return;
+        }
+        if (node->type == NodeType::UNARY_OP) {
+            expression(ast.child(node, 0));
+            masm.neg();
+            return;
+        }
+        Assembler::Operand right = operands(node);
+        switch (node->op) {
+            case Operator::ADD: masm.add(right); break;
+            case Operator::SUB: masm.sub(right); break;
+            case Operator::MUL: masm.imul(right); break;
+            default: divide(right); break;
+        }
+    }
+
+    // What the interpreter does with a zero divisor or INT32_MIN / -1 is up to
+    // it, so both leave the code
+    void divide(const Assembler::Operand& right) {
+        bool safe = right.kind == Assembler::Operand::IMMEDIATE && right.value != 0 && right.value != -1;
+        masm.to_ecx(right);
+        if (!safe) {
+            size_t exit = current_exit();
+            masm.test_ecx();
+            exit_jumps.emplace_back(masm.jump_if(Assembler::E), exit);
+            masm.cmp_ecx_minus_one();
+            size_t fine = masm.jump_if(Assembler::NE);
+            masm.cmp({Assembler::Operand::IMMEDIATE, INT32_MIN});
+            exit_jumps.emplace_back(masm.jump_if(Assembler::E), exit);
+            masm.patch(fine, masm.here());
+        }
+        masm.idiv_ecx();
+    }
+
+    // Jumps unless node's truthiness is `when`, returning the jump to patch
+    size_t jump_unless(Ast::Node* node, bool when) {
+        if (const Value* value = constant(node)) {
+            return value->is_truthy() == when ? Assembler::NO_JUMP : masm.jump();
+        }
+        if (node->type == NodeType::UNARY_OP && node->op == Operator::NOT) {
+            return jump_unless(ast.child(node, 0), !when);
+        }
+        if (is_comparison(node)) {
+            static const Assembler::Condition conditions[] = {
+                Assembler::G, Assembler::L, Assembler::GE, Assembler::LE, Assembler::E, Assembler::NE};
+            masm.cmp(operands(node));
+            Assembler::Condition holds = conditions[static_cast<int>(node->op) - static_cast<int>(Operator::GT)];
+            return masm.jump_if(when ? Assembler::invert(holds) : holds);
+        }
+        expression(node);
+        masm.test_eax();
+        return masm.jump_if(when ? Assembler::E : Assembler::NE);
+    }
+
+    void statement(Ast::Node* node) {
+        path.push_back(id(node));
+        if (!is_native(node)) {
+            exit_jumps.emplace_back(masm.jump(), current_exit());
+            path.pop_back();
+            return;
+        }
+        switch (node->type) {
+            case NodeType::ASSIGNMENT: {
+                expression(ast.child(node, 1));
+                CompiledLoop::Slot& variable = slot(node);
+                masm.store(integer_of(variable.position));
+                masm.store_byte(type_of(variable.position), Value::INT);
+                break;
+            }
+            case NodeType::IF_STATEMENT: {
+                size_t to_else = jump_unless(ast.child(node, 0), true);
+                statement(ast.child(node, 1));
+                if (node->num_children > 2) {
+                    size_t to_end = masm.jump();
+                    masm.patch(to_else, masm.here());
+                    statement(ast.child(node, 2));
+                    masm.patch(to_end, masm.here());
+                } else {
+                    masm.patch(to_else, masm.here());
+                }
+                break;
+            }
+            case NodeType::WHILE_LOOP: {
+                size_t head = masm.here();
+                size_t done = jump_unless(ast.child(node, 0), true);
+                statement(ast.child(node, 1));
+                masm.jump_back(head);
+                masm.patch(done, masm.here());
+                break;
+            }
+            default: { // BLOCK, laid out the way Interpreter::execute_block would
+                const BlockInfo& info = resolver.blocks[node->block];
+                // The code doesn't clear set flags on the way in
+                for (size_t i = 0; i < info.names.size(); ++i) {
+                    if (resolver.checked[info.first_var + i]) ok = false;
+                }
+                size_t saved = next_frame;
+                if (!info.names.empty()) {
+                    inner.emplace_back(info.depth, next_frame);
+                    next_frame += info.names.size();
+                }
+                for (size_t i = 0; i < node->num_children; ++i) statement(ast.child(node, i));
+                if (!info.names.empty()) inner.pop_back();
+                next_frame = saved;
+                break;
+            }
+        }
+        path.pop_back();
+    }
+};
+
+#endif
 
-// A helper struct to wrap the variant and provide utility functions.
-struct Value {
-    ValueVariant data;
+// --- Bytecode ---
+// Register based: an instruction names the registers it reads and writes, so
+// `y = y + x` is one ADD straight into y's register. Registers are laid out as
+// every variable, then the constants (loaded once before running), then
+// temporaries for the middle of expressions.
+enum class Op : uint8_t {
+    MOVE,          // a = b
+    MOVE_SET,      // a = b, and a counts as set (for checked variables)
+    CLEAR,         // checked variable a is no longer set (entering its block)
+    LOAD_DYNAMIC,  // a = whichever candidate of dynamic[b] is set
+    STORE_DYNAMIC, // whichever candidate of dynamic[a] is set (or the first) = b
+    ADD, SUB, MUL, DIV, GT, LT, GE, LE, EQ, NE, // a = b op c
+    NEG, NOT,      // a = op b
+    JUMP,          // go to a
+    JUMP_IF_FALSE, // go to b unless a is truthy
+    JUMP_IF_TRUE,  // go to b if a is truthy
+    LOOP,          // JUMP_IF_TRUE at the bottom of loop c, which counts towards compiling it
+    PRINT,         // print a
+    PRINT_SPACE,
+    PRINT_END,
+    FAIL,          // throw messages[a]
+    HALT
+};
 
-    Value() : data(std::monostate{}) {}
-    Value(bool val) : data(val) {}
-    Value(int val) : data(val) {}
-    Value(double val) : data(val) {}
-    Value(const std::string& val) : data(val) {}
-    Value(const char* val) : data(std::string(val)) {}
+struct Instr {
+    Op op;
+    int32_t a = 0, b = 0, c = 0;
+};
 
-    // Helper to print the value
-    void print() const {
-        std::visit([](auto&& arg) {
-            using T = std::decay_t<decltype(arg)>;
-            if constexpr (std::is_same_v<T, std::monostate>) {
-                std::cout << "null";
-            } else if constexpr (std::is_same_v<T, bool>) {
-                std::cout << (arg ? "true" : "false");
-            } else {
-                std::cout << arg;
+struct Chunk {
+    std::vector<Instr> code;
+    std::vector<Value> constants; // register first_constant + i starts as constants[i]
+    std::vector<DynamicBinding> dynamic;
+    std::vector<std::string> var_names;
+    std::vector<std::string> messages;
+    int num_vars = 0;
+    int first_constant = 0;
+    int num_registers = 0;
+
+    // What compiling a hot loop needs: the program as analysed, each loop and
+    // where each statement's code starts, by node. Only good while the Ast is.
+    struct Loop {
+        uint32_t node;
+        int condition, end; // first instruction of the condition, and after the loop
+    };
+    std::vector<Loop> loops;
+    std::vector<int> statement_start;
+    Ast* ast = nullptr;
+    ConstantFolder folder;
+    Resolver resolver;
+
+    void dump() const {
+        std::ostream& out = std::cout;
+        static const char* names[] = {
+            "MOVE", "MOVE_SET", "CLEAR", "LOAD_DYNAMIC", "STORE_DYNAMIC",
+            "ADD", "SUB", "MUL", "DIV", "GT", "LT", "GE", "LE", "EQ", "NE",
+            "NEG", "NOT", "JUMP", "JUMP_IF_FALSE", "JUMP_IF_TRUE", "LOOP",
+            "PRINT", "PRINT_SPACE", "PRINT_END", "FAIL", "HALT"};
+        for (size_t pc = 0; pc < code.size(); ++pc) {
+            const Instr& in = code[pc];
+            out << pc << "\t" << names[static_cast<int>(in.op)] << "\t" << in.a << " "
+                << in.b << " " << in.c << "\n";
+        }
+        for (int i = 0; i < num_vars; ++i) out << "r" << i << " = " << var_names[i] << "\n";
+        for (size_t i = 0; i < constants.size(); ++i) {
+            out << "r" << first_constant + static_cast<int>(i) << " = ";
+            OutputSink sink(out, 64);
+            constants[i].print(sink);
+            sink.write('\n');
+        }
+    }
+};
+
+class Compiler {
+public:
+    Chunk compile(Ast& program) {
+        ast = &program;
+        folder.fold(program);
+        resolver.resolve(program);
+        chunk.dynamic = resolver.dynamic;
+        chunk.var_names = resolver.var_names;
+        chunk.num_vars = static_cast<int>(resolver.var_names.size());
+        chunk.constants.emplace_back();
+        chunk.statement_start.assign(program.nodes.size(), -1);
+        chunk.ast = &program;
+        null_constant = -1;
+
+        statement(ast->node(ast->root));
+        emit(Op::HALT);
+
+        // Constant registers sit after the variables, temporaries after those
+        int first_temp = chunk.num_vars + static_cast<int>(chunk.constants.size());
+        for (Instr& in : chunk.code) relocate(in, first_temp);
+        chunk.first_constant = chunk.num_vars;
+        chunk.num_registers = first_temp + max_temps;
+        chunk.folder = std::move(folder);
+        chunk.resolver = std::move(resolver);
+        return std::move(chunk);
+    }
+
+private:
+    Ast* ast = nullptr;
+    ConstantFolder folder;
+    Resolver resolver;
+    Chunk chunk;
+    std::map<int, int> constant_register; // folder.constants index -> register
+    int null_constant = 0;
+    int temps = 0, max_temps = 0;
+
+    // While compiling, constants are numbered -1, -2, ... and temporaries from
+    // TEMP up, because neither's final register is known until the end
+    static constexpr int TEMP = 1 << 24;
+
+    int constant(int index) {
+        auto it = constant_register.find(index);
+        if (it != constant_register.end()) return it->second;
+        chunk.constants.push_back(folder.constants[index]);
+        int reg = -static_cast<int>(chunk.constants.size());
+        constant_register[index] = reg;
+        return reg;
+    }
+
+    int temp() {
+        int reg = TEMP + temps++;
+        max_temps = std::max(max_temps, temps);
+        return reg;
+    }
+
+    int fixup(int reg, int first_temp) const {
+        if (reg < 0) return chunk.num_vars + (-reg - 1);
+        if (reg >= TEMP) return first_temp + (reg - TEMP);
+        return reg;
+    }
+
+    // Rewrites the operands of in that are registers
+    void relocate(Instr& in, int first_temp) const {
+        switch (in.op) {
+            case Op::MOVE: case Op::MOVE_SET:
+            case Op::NEG: case Op::NOT:
+                in.a = fixup(in.a, first_temp);
+                in.b = fixup(in.b, first_temp);
+                break;
+            case Op::ADD: case Op::SUB: case Op::MUL: case Op::DIV:
+            case Op::GT: case Op::LT: case Op::GE: case Op::LE:
+            case Op::EQ: case Op::NE:
+                in.a = fixup(in.a, first_temp);
+                in.b = fixup(in.b, first_temp);
+                in.c = fixup(in.c, first_temp);
+                break;
+            case Op::LOAD_DYNAMIC:
+            case Op::JUMP_IF_FALSE: case Op::JUMP_IF_TRUE: case Op::LOOP:
+            case Op::PRINT:
+                in.a = fixup(in.a, first_temp);
+                break;
+            case Op::STORE_DYNAMIC:
+                in.b = fixup(in.b, first_temp);
+                break;
+            default:
+                break;
+        }
+    }
+
+    int emit(Op op, int a = 0, int b = 0, int c = 0) {
+        Instr in;
+        in.op = op;
+        in.a = a;
+        in.b = b;
+        in.c = c;
+        chunk.code.push_back(in);
+        return static_cast<int>(chunk.code.size()) - 1;
+    }
+
+    int here() const { return static_cast<int>(chunk.code.size()); }
+
+    void fail(const std::string& message) {
+        chunk.messages.push_back(message);
+        emit(Op::FAIL, static_cast<int>(chunk.messages.size()) - 1);
+    }
+
+    // Moves the result into dst if the caller asked for a particular register
+    int place(int reg, int dst) {
+        if (dst < 0 || dst == reg) return reg;
+        emit(Op::MOVE, dst, reg);
+        return dst;
+    }
+
+    // Compiles node and returns the register its value ends up in, which is dst
+    // if that's given. Temporaries used on the way are free again afterwards.
+    int expression(const Ast::Node* node, int dst = -1) {
+        if (node->constant >= 0) return place(constant(node->constant), dst);
+        switch (node->type) {
+            case NodeType::VARIABLE: {
+                if (node->var >= 0) return place(node->var, dst);
+                int out = dst >= 0 ? dst : temp();
+                emit(Op::LOAD_DYNAMIC, out, node->dynamic);
+                return out;
+            }
+            case NodeType::BINARY_OP:
+                return binary(node, dst);
+            case NodeType::UNARY_OP: {
+                int saved = temps;
+                int out = dst >= 0 ? dst : temp();
+                int operand = expression(ast->child(node, 0));
+                if (node->op == Operator::NEG) {
+                    emit(Op::NEG, out, operand);
+                } else if (node->op == Operator::NOT) {
+                    emit(Op::NOT, out, operand);
+                } else {
+                    fail("Runtime Error: Invalid unary operator '" + std::string(ast->text(node)) + "'.");
+                }
+                temps = dst >= 0 ? saved : saved + 1;
+                return out;
             }
-        }, data);
+            case NodeType::FUNCTION_CALL:
+                call(node);
+                return place(null_constant, dst);
+            default:
+                fail("Runtime Error: Invalid expression node.");
+                return place(null_constant, dst);
+        }
     }
 
-    // Helper to check for truthiness (like in Python)
-    bool is_truthy() const {
-        return std::visit([](auto&& arg) -> bool {
-            using T = std::decay_t<decltype(arg)>;
-            if constexpr (std::is_same_v<T, std::monostate>) return false;
-            if constexpr (std::is_same_v<T, bool>) return arg;
-            if constexpr (std::is_same_v<T, int>) return arg != 0;
-            if constexpr (std::is_same_v<T, double>) return arg != 0.0;
-            if constexpr (std::is_same_v<T, std::string>) return !arg.empty();
-            return false;
-        }, data);
+    int binary(const Ast::Node* node, int dst) {
+        // Indexed by Operator
+        static const Op ops[] = {Op::ADD, Op::SUB, Op::MUL, Op::DIV, Op::GT,
+                                 Op::LT, Op::GE, Op::LE, Op::EQ, Op::NE};
+        int saved = temps;
+        int out = dst >= 0 ? dst : temp();
+        int left = expression(ast->child(node, 0));
+        int right = expression(ast->child(node, 1));
+        if (node->op <= Operator::NE) {
+            emit(ops[static_cast<int>(node->op)], out, left, right);
+        } else {
+            fail("Runtime Error: Invalid binary operation between types.");
+        }
+        temps = dst >= 0 ? saved : saved + 1;
+        return out;
+    }
+
+    void call(const Ast::Node* node) {
+        if (ast->text(node) != "print") {
+            fail("Runtime Error: Undefined function '" + std::string(ast->text(node)) + "'.");
+            return;
+        }
+        // Each argument is printed as soon as it's evaluated, like the tree walker
+        for (size_t i = 0; i < node->num_children; ++i) {
+            int saved = temps;
+            emit(Op::PRINT, expression(ast->child(node, i)));
+            temps = saved;
+            if (i < node->num_children - 1) emit(Op::PRINT_SPACE);
+        }
+        emit(Op::PRINT_END);
+    }
+
+    void statement(const Ast::Node* node) {
+        if (!node) return;
+        chunk.statement_start[node - ast->nodes.data()] = here();
+        switch (node->type) {
+            case NodeType::PROGRAM:
+            case NodeType::BLOCK: {
+                const BlockInfo& info = resolver.blocks[node->block];
+                for (size_t i = 0; i < info.names.size(); ++i) {
+                    int var = info.first_var + static_cast<int>(i);
+                    if (resolver.checked[var]) emit(Op::CLEAR, var);
+                }
+                for (size_t i = 0; i < node->num_children; ++i) statement(ast->child(node, i));
+                break;
+            }
+            case NodeType::ASSIGNMENT: {
+                int saved = temps;
+                if (node->var >= 0 && !resolver.checked[node->var]) {
+                    expression(ast->child(node, 1), node->var);
+                } else if (node->var >= 0) {
+                    emit(Op::MOVE_SET, node->var, expression(ast->child(node, 1)));
+                } else {
+                    int value = expression(ast->child(node, 1));
+                    emit(Op::STORE_DYNAMIC, node->dynamic, value);
+                }
+                temps = saved;
+                break;
+            }
+            case NodeType::IF_STATEMENT: {
+                int saved = temps;
+                int cond = expression(ast->child(node, 0));
+                temps = saved;
+                int to_else = emit(Op::JUMP_IF_FALSE, cond);
+                statement(ast->child(node, 1));
+                if (node->num_children > 2) {
+                    int to_end = emit(Op::JUMP);
+                    chunk.code[to_else].b = here();
+                    statement(ast->child(node, 2));
+                    chunk.code[to_end].a = here();
+                } else {
+                    chunk.code[to_else].b = here();
+                }
+                break;
+            }
+            case NodeType::WHILE_LOOP: {
+                // The condition goes at the bottom so each iteration takes one jump
+                int to_cond = emit(Op::JUMP);
+                int body = here();
+                statement(ast->child(node, 1));
+                Chunk::Loop loop{static_cast<uint32_t>(node - ast->nodes.data()), here(), 0};
+                chunk.code[to_cond].a = here();
+                int saved = temps;
+                int cond = expression(ast->child(node, 0));
+                temps = saved;
+                emit(Op::LOOP, cond, body, static_cast<int>(chunk.loops.size()));
+                loop.end = here();
+                chunk.loops.push_back(loop);
+                break;
+            }
+            case NodeType::FUNCTION_CALL:
+                call(node);
+                break;
+            default:
+                fail("Runtime Error: Invalid statement node.");
+                break;
+        }
     }
 };
 
-// Represents a node in the Parse Tree (Abstract Syntax Tree)
-enum class NodeType {
-    PROGRAM,
-    BLOCK,
-    ASSIGNMENT,
-    IF_STATEMENT,
-    WHILE_LOOP,
-    FUNCTION_CALL,
-    BINARY_OP,
-    UNARY_OP,
-    VARIABLE,
-    INT_LITERAL,
-    DOUBLE_LITERAL,
-    STRING_LITERAL,
-    BOOL_LITERAL
+// --- Virtual Machine ---
+class VM {
+public:
+    // Whether hot loops are compiled to native code, as for Interpreter
+    void set_jit(bool enabled, uint32_t threshold) {
+        jit = enabled;
+        jit_threshold = threshold;
+    }
+
+    // Prints go to out
+    void run(const Chunk& chunk, OutputSink& out) {
+#if HAVE_JIT
+        std::vector<JitSite> sites(chunk.loops.size());
+#endif
+        std::vector<Value> registers(chunk.num_registers);
+        for (size_t i = 0; i < chunk.constants.size(); ++i) {
+            registers[chunk.first_constant + i] = chunk.constants[i];
+        }
+        std::vector<bool> set(chunk.num_vars, false);
+        Value* R = registers.data();
+        const Instr* code = chunk.code.data();
+        const Instr* ip = code;
+
+// With GCC and Clang every handler jumps straight to the next one through a
+// table of label addresses, which predicts much better than one shared switch
+#if defined(__GNUC__)
+#define VM_CASE(name) L_##name:
+#define VM_NEXT() goto *labels[static_cast<int>((ip)->op)]
+        static void* labels[] = {
+            &&L_MOVE, &&L_MOVE_SET, &&L_CLEAR, &&L_LOAD_DYNAMIC, &&L_STORE_DYNAMIC,
+            &&L_ADD, &&L_SUB, &&L_MUL, &&L_DIV, &&L_GT, &&L_LT, &&L_GE, &&L_LE,
+            &&L_EQ, &&L_NE, &&L_NEG, &&L_NOT, &&L_JUMP, &&L_JUMP_IF_FALSE,
+            &&L_JUMP_IF_TRUE, &&L_LOOP, &&L_PRINT, &&L_PRINT_SPACE, &&L_PRINT_END,
+            &&L_FAIL, &&L_HALT};
+        VM_NEXT();
+#else
+#define VM_CASE(name) case Op::name:
+#define VM_NEXT() continue
+        for (;;) switch (ip->op) {
+#endif
+
+// int op int is done inline, everything else goes through binary_operation
+#define VM_INT_OP(name, expr)                                                        \
+    VM_CASE(name) {                                                                  \
+        const Value& l = R[ip->b];                                                   \
+        const Value& r = R[ip->c];                                                   \
+        if (l.type == Value::INT && r.type == Value::INT) {                          \
+            int a = l.integer, b = r.integer;                                        \
+            R[ip->a].set(expr);                                                      \
+        } else {                                                                     \
+            R[ip->a] = binary_operation(Operator::name, l, r);                       \
+        }                                                                            \
+        ++ip;                                                                        \
+        VM_NEXT();                                                                   \
+    }
+
+        VM_CASE(MOVE) {
+            R[ip->a] = R[ip->b];
+            ++ip;
+            VM_NEXT();
+        }
+        VM_CASE(MOVE_SET) {
+            R[ip->a] = R[ip->b];
+            set[ip->a] = true;
+            ++ip;
+            VM_NEXT();
+        }
+        VM_CASE(CLEAR) {
+            set[ip->a] = false;
+            ++ip;
+            VM_NEXT();
+        }
+        VM_CASE(LOAD_DYNAMIC) {
+            const DynamicBinding& access = chunk.dynamic[ip->b];
+            int var = -1;
+            for (int c : access.candidates) {
+                if (set[c]) {
+                    var = c;
+                    break;
+                }
+            }
+            if (var < 0) {
+                throw std::runtime_error("Runtime Error: Variable '" + access.name + "' not defined.");
+            }
+            R[ip->a] = R[var];
+            ++ip;
+            VM_NEXT();
+        }
+        VM_CASE(STORE_DYNAMIC) {
+            const std::vector<int>& candidates = chunk.dynamic[ip->a].candidates;
+            int var = candidates[0];
+            for (int c : candidates) {
+                if (set[c]) {
+                    var = c;
+                    break;
+                }
+            }
+            R[var] = R[ip->b];
+            set[var] = true;
+            ++ip;
+            VM_NEXT();
+        }
+        VM_INT_OP(ADD, a + b)
+        VM_INT_OP(SUB, a - b)
+        VM_INT_OP(MUL, a * b)
+        VM_INT_OP(DIV, a / b)
+        VM_INT_OP(GT, a > b)
+        VM_INT_OP(LT, a < b)
+        VM_INT_OP(GE, a >= b)
+        VM_INT_OP(LE, a <= b)
+        VM_CASE(EQ) {
+            R[ip->a] = Value(R[ip->b] == R[ip->c]);
+            ++ip;
+            VM_NEXT();
+        }
+        VM_CASE(NE) {
+            R[ip->a] = Value(!(R[ip->b] == R[ip->c]));
+            ++ip;
+            VM_NEXT();
+        }
+        VM_CASE(NEG) {
+            const Value& v = R[ip->b];
+            if (v.type == Value::INT) {
+                R[ip->a] = Value(-v.integer);
+            } else if (v.type == Value::DOUBLE) {
+                R[ip->a] = Value(-v.real);
+            } else {
+                throw std::runtime_error("Runtime Error: Invalid unary operator '-'.");
+            }
+            ++ip;
+            VM_NEXT();
+        }
+        VM_CASE(NOT) {
+            R[ip->a] = Value(!R[ip->b].is_truthy());
+            ++ip;
+            VM_NEXT();
+        }
+        VM_CASE(JUMP) {
+            ip = code + ip->a;
+            VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_FALSE) {
+            ip = R[ip->a].is_truthy() ? ip + 1 : code + ip->b;
+            VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_TRUE) {
+            ip = R[ip->a].is_truthy() ? code + ip->b : ip + 1;
+            VM_NEXT();
+        }
+        VM_CASE(LOOP) {
+            if (!R[ip->a].is_truthy()) {
+                ++ip;
+                VM_NEXT();
+            }
+#if HAVE_JIT
+            if (jit && sites[ip->c].hot(jit_threshold)) {
+                ip = code + run_native(chunk, chunk.loops[ip->c], sites[ip->c], registers, set, ip->b);
+                VM_NEXT();
+            }
+#endif
+            ip = code + ip->b;
+            VM_NEXT();
+        }
+        VM_CASE(PRINT) {
+            R[ip->a].print(out);
+            ++ip;
+            VM_NEXT();
+        }
+        VM_CASE(PRINT_SPACE) {
+            out.write(' ');
+            ++ip;
+            VM_NEXT();
+        }
+        VM_CASE(PRINT_END) {
+            out.write('\n');
+            ++ip;
+            VM_NEXT();
+        }
+        VM_CASE(FAIL) {
+            throw std::runtime_error(chunk.messages[ip->a]);
+        }
+        VM_CASE(HALT) {
+            return;
+        }
+#if !defined(__GNUC__)
+        }
+#endif
+#undef VM_INT_OP
+#undef VM_NEXT
+#undef VM_CASE
+    }
+
+private:
+    bool jit = false;
+    uint32_t jit_threshold = 0;
+
+#if HAVE_JIT
+    // Runs the rest of a hot loop natively, compiling it the first time, if
+    // its guards hold. Returns where to carry on: body if the code wasn't run.
+    int run_native(const Chunk& chunk, const Chunk::Loop& loop, JitSite& site,
+                   std::vector<Value>& registers, const std::vector<bool>& set, int body) {
+        if (!site.loop) {
+            site.loop = LoopCompiler(*chunk.ast, chunk.folder, chunk.resolver).compile(chunk.ast->node(loop.node));
+            site.rejected = !site.loop;
+            if (site.rejected) return body;
+        }
+        if (!site.loop->can_enter(registers.data(), set)) return body;
+        uint32_t exit = site.loop->code->run(registers.data());
+        if (exit == 0) return loop.end;
+        const std::vector<uint32_t>& path = site.loop->exits[exit - 1];
+        return path.empty() ? loop.condition : chunk.statement_start[path.back()];
+    }
+#endif
 };
 
-struct ParseTree {
-    NodeType type;
-    std::string value; // Stores operator, variable name, literal value
-    std::vector<ParseTree*> children;
+// --- Profiler ---
+// Opt-in profile of a tree-walker run: how often each node ran, the time spent
+// in it with and without its children, how many times each loop went round and
+// how far variable lookups reached. Time is read from the TSC where there is
+// one and converted to ms against steady_clock when the run finishes. The
+// interpreter only calls into it from its profiled instantiation, so a run
+// without a profiler pays nothing.
+class Profiler {
+public:
+    struct NodeStats {
+        uint64_t count = 0;
+        uint64_t inclusive = 0, exclusive = 0;  // in ticks
+        uint64_t iterations = 0;                // WHILE_LOOP only
+        uint64_t lookups = 0, lookup_depth = 0, dynamic_lookups = 0;
+    };
 
-    ParseTree(NodeType t, std::string val = "") : type(t), value(val) {}
+    void start(const Ast& program) {
+        ast = program;
+        stats.assign(ast.nodes.size(), NodeStats());
+        frames.clear();
+        paths.clear();
+        path_index.clear();
+        started_time = std::chrono::steady_clock::now();
+        started = ticks();
+    }
 
-    // Destructor to clean up child nodes
-    ~ParseTree() {
-        for (ParseTree* child : children) {
-            delete child;
+    void finish() {
+        uint64_t elapsed = ticks() - started;
+        double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - started_time).count();
+        total = elapsed;
+        ticks_per_ms = ms > 0 && elapsed > 0 ? elapsed / ms : 1;
+    }
+
+    void enter(uint32_t id) {
+        uint32_t parent = frames.empty() ? Ast::NONE : frames.back().path;
+        frames.push_back({id, path(parent, id), ticks(), 0});
+    }
+
+    void exit() {
+        Frame frame = frames.back();
+        frames.pop_back();
+        uint64_t elapsed = ticks() - frame.start;
+        uint64_t self = elapsed - std::min(elapsed, frame.children);
+        NodeStats& node = stats[frame.node];
+        node.count++;
+        node.inclusive += elapsed;
+        node.exclusive += self;
+        paths[frame.path].self += self;
+        if (!frames.empty()) frames.back().children += elapsed;
+    }
+
+    void iteration(uint32_t id) { stats[id].iterations++; }
+
+    // depth is how many blocks out from the current one the variable lives
+    void lookup(uint32_t id, int depth, bool dynamic) {
+        NodeStats& node = stats[id];
+        node.lookups++;
+        node.lookup_depth += depth;
+        node.dynamic_lookups += dynamic;
+    }
+
+    const NodeStats& operator[](uint32_t id) const { return stats[id]; }
+
+    // The top nodes by exclusive time, then every loop and the variables
+    // looked up most
+    void report(std::ostream& out, size_t top = 20) const {
+        std::vector<uint32_t> order;
+        for (uint32_t id = 0; id < stats.size(); ++id) {
+            if (stats[id].count) order.push_back(id);
+        }
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return stats[a].exclusive > stats[b].exclusive;
+        });
+        out << std::fixed << std::setprecision(3);
+        out << "Profile: " << ms(total) << " ms\n";
+        out << std::setw(12) << "count" << std::setw(12) << "incl ms" << std::setw(12) << "excl ms"
+            << "  node\n";
+        for (size_t i = 0; i < order.size() && i < top; ++i) {
+            const NodeStats& node = stats[order[i]];
+            out << std::setw(12) << node.count << std::setw(12) << ms(node.inclusive)
+                << std::setw(12) << ms(node.exclusive) << "  " << label(order[i]) << "\n";
+        }
+
+        out << "Loops:\n" << std::setw(12) << "iterations" << std::setw(12) << "runs"
+            << std::setw(12) << "incl ms" << "  node\n";
+        for (uint32_t id : order) {
+            if (ast.nodes[id].type != NodeType::WHILE_LOOP) continue;
+            const NodeStats& node = stats[id];
+            out << std::setw(12) << node.iterations << std::setw(12) << node.count
+                << std::setw(12) << ms(node.inclusive) << "  " << label(id) << "\n";
         }
+
+        std::vector<uint32_t> lookups;
+        for (uint32_t id : order) {
+            if (stats[id].lookups) lookups.push_back(id);
+        }
+        std::sort(lookups.begin(), lookups.end(), [&](uint32_t a, uint32_t b) {
+            return stats[a].lookups > stats[b].lookups;
+        });
+        out << "Variables:\n" << std::setw(12) << "lookups" << std::setw(12) << "avg depth"
+            << std::setw(12) << "dynamic" << "  node\n";
+        for (size_t i = 0; i < lookups.size() && i < top; ++i) {
+            const NodeStats& node = stats[lookups[i]];
+            out << std::setw(12) << node.lookups << std::setw(12)
+                << static_cast<double>(node.lookup_depth) / node.lookups << std::setw(12)
+                << node.dynamic_lookups << "  " << label(lookups[i]) << "\n";
+        }
+        out << std::defaultfloat;
+    }
+
+    // One line per distinct stack of nodes, outermost first, with the ticks
+    // spent in its innermost node: the input flamegraph.pl and speedscope take
+    void collapsed_stacks(std::ostream& out) const {
+        std::vector<uint32_t> chain;
+        for (const PathNode& path : paths) {
+            if (path.self == 0) continue;
+            chain.clear();
+            for (const PathNode* p = &path;; p = &paths[p->parent]) {
+                chain.push_back(p->node);
+                if (p->parent == Ast::NONE) break;
+            }
+            for (size_t i = chain.size(); i-- > 0;) {
+                std::string frame = label(chain[i]);
+                std::replace(frame.begin(), frame.end(), ';', ':');
+                std::replace(frame.begin(), frame.end(), '\n', ' ');
+                out << frame << (i ? ";" : " ");
+            }
+            out << path.self << "\n";
+        }
+    }
+
+private:
+    struct Frame {
+        uint32_t node, path;
+        uint64_t start, children;
+    };
+    // The stacks seen so far as a tree: one entry per distinct (caller, node)
+    struct PathNode {
+        uint32_t node, parent;
+        uint64_t self = 0;
+    };
+
+    Ast ast;
+    std::vector<NodeStats> stats;
+    std::vector<Frame> frames;
+    std::vector<PathNode> paths;
+    std::unordered_map<uint64_t, uint32_t> path_index;
+    uint64_t started = 0, total = 0;
+    std::chrono::steady_clock::time_point started_time;
+    double ticks_per_ms = 1;
+
+    static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+    double ms(uint64_t t) const { return t / ticks_per_ms; }
+
+    uint32_t path(uint32_t parent, uint32_t node) {
+        uint64_t key = static_cast<uint64_t>(parent) << 32 | node;
+        auto [it, inserted] = path_index.try_emplace(key, static_cast<uint32_t>(paths.size()));
+        if (inserted) paths.push_back({node, parent});
+        return it->second;
+    }
+
+    std::string label(uint32_t id) const {
+        static const char* names[] = {
+            "PROGRAM", "BLOCK", "ASSIGNMENT", "IF_STATEMENT", "WHILE_LOOP", "FUNCTION_CALL",
+            "BINARY_OP", "UNARY_OP", "VARIABLE", "INT_LITERAL", "DOUBLE_LITERAL",
+            "STRING_LITERAL", "BOOL_LITERAL"};
+        const Ast::Node& node = ast.nodes[id];
+        std::string text = names[static_cast<int>(node.type)];
+        std::string_view name = ast.text(&node);
+        if (node.type == NodeType::ASSIGNMENT) name = ast.text(&ast.nodes[ast.edges[node.first_child]]);
+        if (!name.empty()) {
+            text += " ";
+            text += name.size() > 24 ? std::string(name.substr(0, 21)) + "..." : std::string(name);
+        }
+        if (node.line) text += " (line " + std::to_string(node.line) + ")";
+        return text;
+    }
+};
+
+// Times a node for as long as it's in scope, in the profiled tree walker only.
+// Leaving by an exception closes the node the same way.
+template <bool Profiled>
+struct ProfileScope {
+    Profiler* profiler;
+    ProfileScope(Profiler* p, uint32_t id) : profiler(p) {
+        if constexpr (Profiled) profiler->enter(id);
+    }
+    ~ProfileScope() {
+        if constexpr (Profiled) profiler->exit();
     }
 };
 
-// The main interpreter class
+// The main interpreter class. By default programs are compiled to bytecode and
+// run on the VM; TREE walks the Ast directly and is kept as the reference the
+// VM has to agree with.
 class Interpreter {
+public:
+    enum class Mode { BYTECODE, TREE };
+
 private:
-    std::vector<std::map<std::string, Value>> scopes;
+    Mode mode;
+    Ast* ast = nullptr;
+    ConstantFolder folder;
+    Resolver resolver;
+    // The slots of every active block, outermost first, up to top. frame[d] is
+    // where the block at depth d starts, set[i] whether stack[i] has been
+    // assigned yet (only looked at for checked variables). Sized for the whole
+    // run before it starts, so entering a block allocates nothing.
+    std::vector<Value> stack;
+    std::vector<bool> set;
+    std::vector<size_t> frame;
+    size_t top = 0;
+    Profiler* profiler = nullptr;
+    OutputSink standard_output;
+    OutputSink* output = &standard_output;
+    int current_depth = 0;  // of the innermost active block, kept when profiling
+    bool jit = HAVE_JIT;
+    uint32_t jit_threshold = DEFAULT_JIT_THRESHOLD;
+#if HAVE_JIT
+    std::vector<JitSite> jit_sites; // by node, for the WHILE_LOOPs
+#endif
 
-    // --- Scope Management ---
-    void push_scope() {
-        scopes.emplace_back();
+    // --- Variable Access ---
+    size_t position(int var) const {
+        return frame[resolver.depth_of(var)] + resolver.slot_of(var);
     }
 
-    void pop_scope() {
-        if (!scopes.empty()) {
-            scopes.pop_back();
+    // The candidate of a DynamicBinding that is set, or -1
+    int find_dynamic(const DynamicBinding& binding) const {
+        for (int var : binding.candidates) {
+            if (set[position(var)]) return var;
         }
+        return -1;
     }
 
-    void set_variable(const std::string& name, const Value& val) {
-        // Search from the innermost scope outwards
-        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
-            if (it->count(name)) {
-                (*it)[name] = val;
-                return;
+    uint32_t id(const Ast::Node* node) const { return static_cast<uint32_t>(node - ast->nodes.data()); }
+
+    template <bool Profiled>
+    void set_variable(const Ast::Node* node, const Value& val) {
+        size_t pos;
+        if (node->dynamic < 0) {
+            if constexpr (Profiled) profiler->lookup(id(node), current_depth - node->depth, false);
+            pos = frame[node->depth] + node->slot;
+        } else {
+            const DynamicBinding& binding = resolver.dynamic[node->dynamic];
+            int var = find_dynamic(binding);
+            if constexpr (Profiled) {
+                int depth = resolver.depth_of(var >= 0 ? var : binding.candidates[0]);
+                profiler->lookup(id(node), current_depth - depth, true);
             }
+            // If not found, define it in the innermost scope that could have it
+            pos = position(var >= 0 ? var : binding.candidates[0]);
         }
-        // If not found, define it in the current (innermost) scope
-        scopes.back()[name] = val;
+        stack[pos] = val;
+        set[pos] = true;
     }
 
-    Value get_variable(const std::string& name) {
-        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
-            if (it->count(name)) {
-                return (*it).at(name);
-            }
+    template <bool Profiled>
+    const Value& get_variable(const Ast::Node* node) const {
+        if (node->dynamic < 0) {
+            if constexpr (Profiled) profiler->lookup(id(node), current_depth - node->depth, false);
+            return stack[frame[node->depth] + node->slot];
         }
-        throw std::runtime_error("Runtime Error: Variable '" + name + "' not defined.");
+        const DynamicBinding& binding = resolver.dynamic[node->dynamic];
+        int var = find_dynamic(binding);
+        if (var < 0) {
+            throw std::runtime_error("Runtime Error: Variable '" + binding.name + "' not defined.");
+        }
+        if constexpr (Profiled) profiler->lookup(id(node), current_depth - resolver.depth_of(var), true);
+        return stack[position(var)];
     }
 
     // --- Expression Evaluation ---
-    Value evaluate_expression(ParseTree* node) {
+    template <bool Profiled>
+    Value evaluate_expression(Ast::Node* node) {
+        ProfileScope<Profiled> scope(profiler, id(node));
+        // Literals, and operators over nothing but literals, are already worked out
+        if (node->constant >= 0) return folder.constants[node->constant];
         switch (node->type) {
-            case NodeType::INT_LITERAL:
-                return Value(std::stoi(node->value));
-            case NodeType::DOUBLE_LITERAL:
-                return Value(std::stod(node->value));
-            case NodeType::STRING_LITERAL:
-                return Value(node->value);
-            case NodeType::BOOL_LITERAL:
-                return Value(node->value == "true");
             case NodeType::VARIABLE:
-                return get_variable(node->value);
+                return get_variable<Profiled>(node);
             case NodeType::BINARY_OP:
-                return evaluate_binary_op(node);
+                return evaluate_binary_op<Profiled>(node);
             case NodeType::UNARY_OP:
-                 return evaluate_unary_op(node);
+                 return evaluate_unary_op<Profiled>(node);
             case NodeType::FUNCTION_CALL: // Can be an expression if it returns a value
-                return execute_function_call(node);
+                return execute_function_call<Profiled>(node);
             default:
                 throw std::runtime_error("Runtime Error: Invalid expression node.");
         }
     }
 
-    Value evaluate_unary_op(ParseTree* node) {
-        Value right = evaluate_expression(node->children[0]);
-        if (node->value == "-") {
-            if (std::holds_alternative<int>(right.data)) return Value(-std::get<int>(right.data));
-            if (std::holds_alternative<double>(right.data)) return Value(-std::get<double>(right.data));
-        } else if (node->value == "!") {
-             return Value(!right.is_truthy());
-        }
-        throw std::runtime_error("Runtime Error: Invalid unary operator '" + node->value + "'.");
+    template <bool Profiled>
+    Value evaluate_unary_op(Ast::Node* node) {
+        Value right = evaluate_expression<Profiled>(ast->child(node, 0));
+        return unary_operation(node->op, ast->text(node), right);
     }
 
-
-    Value evaluate_binary_op(ParseTree* node) {
-        Value left = evaluate_expression(node->children[0]);
-        Value right = evaluate_expression(node->children[1]);
-        const std::string& op = node->value;
-
-        // Numeric operations
-        if (std::holds_alternative<int>(left.data) && std::holds_alternative<int>(right.data)) {
-            int l = std::get<int>(left.data);
-            int r = std::get<int>(right.data);
-            if (op == "+") return Value(l + r);
-            if (op == "-") return Value(l - r);
-            if (op == "*") return Value(l * r);
-            if (op == "/") return Value(l / r);
-            if (op == ">") return Value(l > r);
-            if (op == "<") return Value(l < r);
-            if (op == ">=") return Value(l >= r);
-            if (op == "<=") return Value(l <= r);
+    template <bool Profiled>
+    Value evaluate_binary_op(Ast::Node* node) {
+        Value left = evaluate_expression<Profiled>(ast->child(node, 0));
+        Value right = evaluate_expression<Profiled>(ast->child(node, 1));
+        switch (node->specialization) {
+            case Specialization::INT:
+                if (left.type == Value::INT && right.type == Value::INT) {
+                    return int_operation(node->op, left.integer, right.integer);
+                }
+                break;
+            case Specialization::DOUBLE:
+                if (left.type == Value::DOUBLE && right.type == Value::DOUBLE) {
+                    return double_operation(node->op, left.real, right.real);
+                }
+                break;
+            case Specialization::STRING:
+                if (left.type == Value::STRING && right.type == Value::STRING) {
+                    return Value::concat(std::move(left), right);
+                }
+                break;
+            case Specialization::UNSEEN:
+                node->specialization = specialize(node->op, left, right);
+                return binary_operation(node->op, left, right);
+            case Specialization::GENERIC:
+                return binary_operation(node->op, left, right);
         }
+        // The operand types changed since the site specialized
+        node->specialization = Specialization::GENERIC;
+        return binary_operation(node->op, left, right);
+    }
 
-        // Promote int to double if mixing types
-        double l = std::holds_alternative<int>(left.data) ? std::get<int>(left.data) : std::get<double>(left.data);
-        double r = std::holds_alternative<int>(right.data) ? std::get<int>(right.data) : std::get<double>(right.data);
-
-        if (op == "+") return Value(l + r);
-        if (op == "-") return Value(l - r);
-        if (op == "*") return Value(l * r);
-        if (op == "/") return Value(l / r);
-        if (op == ">") return Value(l > r);
-        if (op == "<") return Value(l < r);
-        if (op == ">=") return Value(l >= r);
-        if (op == "<=") return Value(l <= r);
-
-        // String Concatenation
-        if (op == "+" && std::holds_alternative<std::string>(left.data) && std::holds_alternative<std::string>(right.data)) {
-            return Value(std::get<std::string>(left.data) + std::get<std::string>(right.data));
+    static Specialization specialize(Operator op, const Value& left, const Value& right) {
+        if (op > Operator::NE) return Specialization::GENERIC;
+        if (left.type == Value::INT && right.type == Value::INT) return Specialization::INT;
+        if (left.type == Value::DOUBLE && right.type == Value::DOUBLE) return Specialization::DOUBLE;
+        if (op == Operator::ADD && left.type == Value::STRING && right.type == Value::STRING) {
+            return Specialization::STRING;
         }
-
-        // Equality operators (can work on mixed types)
-        if (op == "==") return Value(left.data == right.data);
-        if (op == "!=") return Value(left.data != right.data);
-
-        throw std::runtime_error("Runtime Error: Invalid binary operation between types.");
+        return Specialization::GENERIC;
     }
 
     // --- Statement Execution ---
-    void execute_statement(ParseTree* node) {
+    template <bool Profiled>
+    void execute_statement(Ast::Node* node) {
         if (!node) return;
+        ProfileScope<Profiled> scope(profiler, id(node));
 
         switch (node->type) {
             case NodeType::PROGRAM:
             case NodeType::BLOCK:
-                execute_block(node);
+                execute_block<Profiled>(node);
                 break;
             case NodeType::ASSIGNMENT: {
-                std::string var_name = node->children[0]->value;
-                Value val = evaluate_expression(node->children[1]);
-                set_variable(var_name, val);
+                Value val = evaluate_expression<Profiled>(ast->child(node, 1));
+                set_variable<Profiled>(node, val);
                 break;
             }
             case NodeType::IF_STATEMENT: {
-                Value condition = evaluate_expression(node->children[0]);
+                Value condition = evaluate_expression<Profiled>(ast->child(node, 0));
                 if (condition.is_truthy()) {
-                    execute_statement(node->children[1]);
-                } else if (node->children.size() > 2) { // Else clause exists
-                    execute_statement(node->children[2]);
+                    execute_statement<Profiled>(ast->child(node, 1));
+                } else if (node->num_children > 2) { // Else clause exists
+                    execute_statement<Profiled>(ast->child(node, 2));
                 }
                 break;
             }
             case NodeType::WHILE_LOOP: {
-                while (evaluate_expression(node->children[0]).is_truthy()) {
-                    execute_statement(node->children[1]);
+                while (evaluate_expression<Profiled>(ast->child(node, 0)).is_truthy()) {
+                    if constexpr (Profiled) profiler->iteration(id(node));
+                    execute_statement<Profiled>(ast->child(node, 1));
+#if HAVE_JIT
+                    // Profiles are of the tree walker, so they never go native
+                    if constexpr (!Profiled) {
+                        if (jit && jit_sites[id(node)].hot(jit_threshold) && run_native(node)) break;
+                    }
+#endif
                 }
                 break;
             }
             case NodeType::FUNCTION_CALL:
-                execute_function_call(node);
+                execute_function_call<Profiled>(node);
                 break;
             default:
                 throw std::runtime_error("Runtime Error: Invalid statement node.");
         }
     }
 
-    void execute_block(ParseTree* block_node) {
-        push_scope();
-        for (ParseTree* statement : block_node->children) {
-            execute_statement(statement);
+    template <bool Profiled>
+    void execute_block(Ast::Node* block_node) {
+        const BlockInfo& info = resolver.blocks[block_node->block];
+        int outer_depth = current_depth;
+        if constexpr (Profiled) current_depth = info.depth;
+        // A block without variables of its own needs no frame
+        if (info.names.empty()) {
+            for (size_t i = 0; i < block_node->num_children; ++i) {
+                execute_statement<Profiled>(ast->child(block_node, i));
+            }
+            if constexpr (Profiled) current_depth = outer_depth;
+            return;
+        }
+        // Slots left over from an earlier block are reused as they are: a
+        // variable that isn't checked is always assigned before it's read
+        size_t base = top;
+        frame[info.depth] = base;
+        top += info.names.size();
+        for (size_t i = 0; i < info.names.size(); ++i) {
+            if (resolver.checked[info.first_var + i]) set[base + i] = false;
+        }
+        for (size_t i = 0; i < block_node->num_children; ++i) {
+            execute_statement<Profiled>(ast->child(block_node, i));
+        }
+        top = base;
+        if constexpr (Profiled) current_depth = outer_depth;
+    }
+
+
+#if HAVE_JIT
+    // --- Native Loops ---
+    // Runs the rest of a hot loop natively, compiling it the first time, if
+    // its guards hold. True if that finished the loop.
+    bool run_native(Ast::Node* node) {
+        JitSite& site = jit_sites[id(node)];
+        if (!site.loop) {
+            site.loop = LoopCompiler(*ast, folder, resolver).compile(node, frame, top);
+            site.rejected = !site.loop;
+            if (site.rejected) return false;
         }
-        pop_scope();
+        const CompiledLoop& loop = *site.loop;
+        if (!loop.can_enter(stack.data(), set)) return false;
+        uint32_t exit = loop.code->run(stack.data());
+        if (exit == 0) return true;
+        const std::vector<uint32_t>& path = loop.exits[exit - 1];
+        if (!path.empty()) resume(path, 0);
+        return false;
     }
 
+    // Finishes the iteration a compiled loop left by a side exit: runs the
+    // statement at the end of path, then what's left of each one around it
+    void resume(const std::vector<uint32_t>& path, size_t level) {
+        Ast::Node* node = ast->node(path[level]);
+        if (level + 1 == path.size()) {
+            execute_statement<false>(node);
+            return;
+        }
+        switch (node->type) {
+            case NodeType::BLOCK: {
+                const BlockInfo& info = resolver.blocks[node->block];
+                size_t base = top;
+                if (!info.names.empty()) {
+                    frame[info.depth] = base;
+                    top += info.names.size();
+                }
+                size_t i = 0;
+                while (ast->edges[node->first_child + i] != path[level + 1]) ++i;
+                resume(path, level + 1);
+                for (++i; i < node->num_children; ++i) execute_statement<false>(ast->child(node, i));
+                top = base;
+                break;
+            }
+            case NodeType::WHILE_LOOP:
+                resume(path, level + 1);
+                execute_statement<false>(node); // and carry on looping
+                break;
+            default: // IF_STATEMENT
+                resume(path, level + 1);
+                break;
+        }
+    }
+#endif
 
-    Value execute_function_call(ParseTree* node) {
-        std::string func_name = node->value;
+    template <bool Profiled>
+    Value execute_function_call(Ast::Node* node) {
+        std::string func_name(ast->text(node));
         if (func_name == "print") {
-            for (size_t i = 0; i < node->children.size(); ++i) {
-                evaluate_expression(node->children[i]).print();
-                if (i < node->children.size() - 1) {
-                    std::cout << " ";
+            for (size_t i = 0; i < node->num_children; ++i) {
+                evaluate_expression<Profiled>(ast->child(node, i)).print(*output);
+                if (i < node->num_children - 1) {
+                    output->write(' ');
                 }
             }
-            std::cout << std::endl;
+            output->write('\n');
             return Value(); // print returns null
         }
         throw std::runtime_error("Runtime Error: Undefined function '" + func_name + "'.");
@@ -265,20 +2800,145 @@ private:
 
 
 public:
+    static constexpr uint32_t DEFAULT_JIT_THRESHOLD = 1000;
+
+    Interpreter(Mode mode = Mode::BYTECODE) : mode(mode) {}
+
+    // Whether while loops are compiled to native code once they have run
+    // threshold iterations. Only does anything where HAVE_JIT is set.
+    void set_jit(bool enabled, uint32_t threshold = DEFAULT_JIT_THRESHOLD) {
+        jit = HAVE_JIT && enabled;
+        jit_threshold = threshold;
+    }
+
+    // Where print writes, until it's set back to nullptr for std::cout. The
+    // sink is flushed at the end of every run.
+    void set_output(OutputSink* sink) { output = sink ? sink : &standard_output; }
+
+    // Profiles every run until it's set back to nullptr. Profiling always walks
+    // the tree, whatever the mode, so that times can be put against nodes.
+    void set_profiler(Profiler* p) { profiler = p; }
+
     void interpret(ParseTree* root) {
-        if (root == nullptr) return;
-        if (root->type != NodeType::PROGRAM) {
+        Ast program(root);
+        interpret(program);
+    }
+
+    void interpret(Ast& program) {
+        try {
+            run(program);
+        } catch (...) {
+            output->flush();
+            throw;
+        }
+        output->flush();
+    }
+
+private:
+    void run(Ast& program) {
+        if (program.root == Ast::NONE) return;
+        if (program.node(program.root)->type != NodeType::PROGRAM) {
             throw std::runtime_error("Interpreter Error: Root node must be a PROGRAM.");
         }
-        // Global scope
-        push_scope();
-        execute_statement(root);
-        pop_scope();
+        if (mode == Mode::BYTECODE && !profiler) {
+            VM vm;
+            vm.set_jit(jit, jit_threshold);
+            vm.run(Compiler().compile(program), *output);
+            return;
+        }
+        ast = &program;
+        folder = ConstantFolder();
+        folder.fold(program);
+        resolver = Resolver();
+        resolver.resolve(program);
+        stack.assign(resolver.max_slots, Value());
+        set.assign(resolver.max_slots, false);
+        frame.assign(resolver.max_depth + 1, 0);
+        top = 0;
+        current_depth = 0;
+#if HAVE_JIT
+        if (jit) {
+            jit_sites.clear();
+            jit_sites.resize(program.nodes.size());
+        }
+#endif
+        if (!profiler) {
+            execute_statement<false>(ast->node(ast->root));
+            return;
+        }
+        profiler->start(program);
+        try {
+            execute_statement<true>(ast->node(ast->root));
+        } catch (...) {
+            profiler->finish();
+            throw;
+        }
+        profiler->finish();
     }
 };
 
+// Parses and runs the script at path
+int run_file(const std::string& path, Interpreter::Mode mode, bool dump, bool jit, Profiler* profiler) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Could not open " << path << std::endl;
+        return 1;
+    }
+    std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    try {
+        Ast ast = Parser().parse(source);
+        if (dump) {
+            Ast copy = ast;
+            Compiler().compile(copy).dump();
+        }
+        Interpreter interpreter(mode);
+        interpreter.set_jit(jit);
+        interpreter.set_profiler(profiler);
+        interpreter.interpret(ast);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
 // --- Main function to build a tree and run the interpreter ---
-int main() {
+// Given a script it runs that instead. --tree runs it on the tree walker instead
+// of the VM, --bytecode prints what it compiles to first. --profile prints a
+// profile of the run to stderr, --flamegraph FILE writes it as collapsed stacks.
+// --no-jit keeps the tree walker from compiling hot loops.
+void write_profile(const Profiler& profiler, bool report, const std::string& flamegraph) {
+    if (report) profiler.report(std::cerr);
+    if (flamegraph.empty()) return;
+    std::ofstream out(flamegraph);
+    if (!out) {
+        std::cerr << "Could not open " << flamegraph << std::endl;
+        return;
+    }
+    profiler.collapsed_stacks(out);
+}
+
+int main(int argc, char** argv) {
+    Interpreter::Mode mode = Interpreter::Mode::BYTECODE;
+    bool dump = false, profile = false, jit = true;
+    std::string script, flamegraph;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--tree") mode = Interpreter::Mode::TREE;
+        else if (arg == "--bytecode") dump = true;
+        else if (arg == "--profile") profile = true;
+        else if (arg == "--no-jit") jit = false;
+        else if (arg == "--flamegraph" && i + 1 < argc) flamegraph = argv[++i];
+        else script = arg;
+    }
+    Profiler profiler;
+    Profiler* active = profile || !flamegraph.empty() ? &profiler : nullptr;
+    if (!script.empty()) {
+        int status = run_file(script, mode, dump, jit, active);
+        if (active) write_profile(profiler, profile, flamegraph);
+        return status;
+    }
+
     // Let's manually build a parse tree for the following code:
     //
     // x = 10;
@@ -356,13 +3016,21 @@ int main() {
     final_print->children.push_back(new ParseTree(NodeType::VARIABLE, "y"));
     program->children.push_back(final_print);
 
+    if (dump) {
+        Ast ast(program);
+        Compiler().compile(ast).dump();
+    }
+
     // Run the interpreter
-    Interpreter interpreter;
+    Interpreter interpreter(mode);
+    interpreter.set_jit(jit);
+    interpreter.set_profiler(active);
     try {
         interpreter.interpret(program);
     } catch (const std::runtime_error& e) {
         std::cerr << e.what() << std::endl;
     }
+    if (active) write_profile(profiler, profile, flamegraph);
 
     // Clean up the manually allocated tree
     delete program;
@@ -9,20 +9,57 @@
  * AVLMap becomes HashMap (these implementations are exactly the same)
  * main functions and everything else is exactly the same
  *
+ * Engine specific extras added later:
+ *  - avl.cpp: read_input_sorted builds the tree in one go from sorted windows
+ *
  * Discussed problem statement with Abhishek Amani
  * Code: all me!
  */
+#include "../as1/SparseMatrix.h"
+
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cctype>
+#include <cmath>
+#include <csignal>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
 #include <random>
+#include <span>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
 
 #define LENGTH 27
+// buckets in the probe histogram, the last one catches everything longer
+#define HIST 16
+
+// build with -DMAP_STATS to count what the map engines are doing. with it off
+// every STAT(...) expands to nothing so the normal build doesnt pay for it
+#ifdef MAP_STATS
+#define STAT(...) __VA_ARGS__
+#else
+#define STAT(...)
+#endif
+
 /**
  * use occurs(c) to update.
  * increment a counter for character c every time c occurs
@@ -42,6 +79,122 @@ template <typename K, typename V> struct pair {
   }
 };
 
+// snapshot of the counters a map engine keeps. some fields only make sense for
+// one of the engines (rotations for the AVL, buckets for the hash table), the
+// other one just leaves them at 0
+struct MapStats {
+  bool counting = false; // false when built without MAP_STATS
+  int size = 0;
+  long long lookups = 0;
+  long long comparisons = 0; // key comparisons done by find
+  long long inserts = 0;
+  long long removes = 0;
+  long long rotations = 0;
+  int height = 0;
+  int max_height = 0;
+  int buckets = 0;
+  int used_buckets = 0;
+  int longest_chain = 0;
+  long long allocated = 0; // bytes of nodes and bucket arrays
+  long long freed = 0;
+  // probes[i] is how many finds looked at i nodes before they were done
+  std::array<long long, HIST> probes{};
+
+  void to_json(std::ostream &out) const {
+    out << "{\"counting\": " << (counting ? "true" : "false")
+        << ", \"size\": " << size << ", \"lookups\": " << lookups
+        << ", \"comparisons\": " << comparisons
+        << ", \"comparisons_per_lookup\": "
+        << (lookups ? (double)comparisons / lookups : 0.0)
+        << ", \"inserts\": " << inserts << ", \"removes\": " << removes
+        << ", \"rotations\": " << rotations << ", \"height\": " << height
+        << ", \"max_height\": " << max_height << ", \"buckets\": " << buckets
+        << ", \"used_buckets\": " << used_buckets
+        << ", \"longest_chain\": " << longest_chain
+        << ", \"bytes_allocated\": " << allocated
+        << ", \"bytes_freed\": " << freed << ", \"probes\": [";
+    for (int i = 0; i < HIST; i++) {
+      out << (i ? ", " : "") << probes[i];
+    }
+    out << "]}";
+  }
+};
+
+// bytes the block at p takes up in the heap. the allocator can hand out more
+// than was asked for, and glibc keeps a size word in front of every block, the
+// difference from what was asked for is slack
+inline size_t allocated_size(const void *p) {
+#ifdef __APPLE__
+  return malloc_size(p);
+#else
+  return malloc_usable_size(const_cast<void *>(p)) + sizeof(size_t);
+#endif
+}
+
+// where the memory of a map goes, measured by asking the allocator about every
+// block the map owns. see the engines' memory_usage
+struct MemoryUsage {
+  long long contexts = 0;
+  long long node_overhead = 0; // links, heights, stored hashes and padding
+  long long key_inline = 0;    // the key objects inside the nodes
+  long long key_heap = 0;      // blocks the keys point to, 0 for short strings
+  long long value_bytes = 0;
+  long long buckets = 0;
+  long long slack = 0; // handed out by the allocator past what was asked for
+
+  long long total() const {
+    return node_overhead + key_inline + key_heap + value_bytes + buckets +
+           slack;
+  }
+
+  // one entry of a map. block is what the allocator gave its node, 0 when the
+  // node is part of a bigger block that gets counted on its own
+  template <typename K, typename V>
+  void add_entry(const pair<K, V> &entry, size_t node_size, size_t block) {
+    contexts++;
+    key_inline += sizeof(K);
+    value_bytes += sizeof(V);
+    node_overhead += node_size - sizeof(K) - sizeof(V);
+    if (block > 0) {
+      slack += block - node_size;
+    }
+    add_heap(entry.first);
+  }
+
+  // a string keeps short keys in its own bytes, longer ones in a block of
+  // capacity + 1
+  void add_heap(const std::string &key) {
+    const char *at = key.data();
+    const char *self = reinterpret_cast<const char *>(&key);
+    if (at >= self && at < self + sizeof(key)) {
+      return;
+    }
+    size_t asked = key.capacity() + 1;
+    key_heap += asked;
+    slack += allocated_size(at) - asked;
+  }
+  template <typename K> void add_heap(const K &) {}
+
+  void to_json(std::ostream &out) const {
+    auto per = [&](long long bytes) {
+      return contexts ? (double)bytes / contexts : 0.0;
+    };
+    out << "{\"contexts\": " << contexts << ", \"bytes\": " << total()
+        << ", \"node_overhead\": " << node_overhead
+        << ", \"key_inline\": " << key_inline
+        << ", \"key_heap\": " << key_heap
+        << ", \"value_bytes\": " << value_bytes
+        << ", \"buckets\": " << buckets << ", \"slack\": " << slack
+        << ", \"per_context\": {\"bytes\": " << per(total())
+        << ", \"node_overhead\": " << per(node_overhead)
+        << ", \"key_inline\": " << per(key_inline)
+        << ", \"key_heap\": " << per(key_heap)
+        << ", \"value_bytes\": " << per(value_bytes)
+        << ", \"buckets\": " << per(buckets) << ", \"slack\": " << per(slack)
+        << "}}";
+  }
+};
+
 template <typename T> struct Node {
   T key;
   int height;
@@ -54,6 +207,11 @@ template <typename T> struct Node {
     right = nullptr;
     height = 1;
   }
+  Node() {
+    left = nullptr;
+    right = nullptr;
+    height = 1;
+  }
 
   bool operator<(const Node &other) const { return this->key < other.key; };
   bool operator>(const Node &other) const { return this->key > other.key; };
@@ -64,6 +222,71 @@ template <typename T> class AVL {
 private:
   Node<T> *root;
   int size;
+  // nodes made by build_sorted all live in one array. they can't be deleted one
+  // by one, so free_node leaves them alone and the destructor frees the array.
+  // it's raw memory instead of a new[] so slab is the allocator's own pointer
+  // (new[] can put a count in front), see memory_usage
+  Node<T> *slab;
+  int slab_len;
+#ifdef MAP_STATS
+  MapStats st;
+#endif
+
+  bool in_slab(Node<T> *n) {
+    std::less<Node<T> *> lt;
+    return slab != nullptr && !lt(n, slab) && lt(n, slab + slab_len);
+  }
+
+  void free_node(Node<T> *n) {
+    if (!in_slab(n)) {
+      delete n;
+    }
+    STAT(st.freed += sizeof(Node<T>));
+  }
+
+  void free_all(Node<T> *node) {
+    if (node == nullptr) {
+      return;
+    }
+    free_all(node->left);
+    free_all(node->right);
+    free_node(node);
+  }
+
+  // links slab[lo..hi] into a perfectly balanced subtree, the middle node
+  // becomes the root. every level is full except maybe the last one so the
+  // heights come out AVL balanced without any rotations
+  Node<T> *link_sorted(int lo, int hi) {
+    if (lo > hi) {
+      return nullptr;
+    }
+    int mid = lo + (hi - lo) / 2;
+    Node<T> *node = &slab[mid];
+    node->left = link_sorted(lo, mid - 1);
+    node->right = link_sorted(mid + 1, hi);
+    node->height = 1 + std::max(getHeight(node->left), getHeight(node->right));
+    return node;
+  }
+
+  Node<T> *copy_at(Node<T> *node) {
+    if (node == nullptr) {
+      return nullptr;
+    }
+    Node<T> *copy = new Node<T>(node->key);
+    copy->height = node->height;
+    copy->left = copy_at(node->left);
+    copy->right = copy_at(node->right);
+    return copy;
+  }
+
+  template <typename F> void for_each_at(Node<T> *node, F &f) {
+    if (node == nullptr) {
+      return;
+    }
+    for_each_at(node->left, f);
+    f(node->key);
+    for_each_at(node->right, f);
+  }
 
   Node<T> *minValueNode(Node<T> *node) {
     Node<T> *current = node;
@@ -88,6 +311,7 @@ private:
   Node<T> *rightRotate(Node<T> *y) {
     Node<T> *x = y->left;
     Node<T> *T2 = x->right;
+    STAT(++st.rotations);
 
     x->right = y;
     y->left = T2;
@@ -101,6 +325,7 @@ private:
   Node<T> *leftRotate(Node<T> *x) {
     Node<T> *y = x->right;
     Node<T> *T2 = y->left;
+    STAT(++st.rotations);
 
     // perform rotation
     y->left = x;
@@ -118,6 +343,8 @@ private:
   Node<T> *insert_at(Node<T> *node, T key, T *&inserted_item) {
     if (node == nullptr) {
       Node<T> *new_node = new Node(key);
+      STAT(st.allocated += sizeof(Node<T>));
+      size++;
       inserted_item = &new_node->key;
       return new_node;
     }
@@ -191,7 +418,8 @@ private:
         } else
           *root = *temp;
 
-        delete temp;
+        free_node(temp);
+        size--;
       } else {
         Node<T> *temp = minValueNode(root->right);
 
@@ -238,18 +466,24 @@ private:
     return root;
   }
   T *find_at(Node<T> *root, T key) {
+    STAT(++st.lookups);
     // nullptr
     if (!root) {
+      STAT(++st.probes[0]);
       return nullptr;
     }
 
     Node<T> *iter = root;
+    STAT(int seen = 0);
     while (iter != nullptr) {
+      STAT(++seen; ++st.comparisons);
       if (iter->key == key) {
         // get the address of the key value, not the actual value
         // because we need to return a reference to the obj instead...
+        STAT(++st.probes[std::min(seen, HIST - 1)]);
         return &iter->key;
       }
+      STAT(++st.comparisons);
       if (iter->key < key) {
         iter = iter->right;
       } else {
@@ -257,6 +491,7 @@ private:
       }
     }
     // not found
+    STAT(++st.probes[std::min(seen, HIST - 1)]);
     return nullptr;
   }
 
@@ -264,19 +499,152 @@ public:
   AVL() {
     root = nullptr;
     size = 0;
+    slab = nullptr;
+    slab_len = 0;
+  }
+
+  // deep copy. the copy gets normal nodes even if other was built sorted
+  AVL(const AVL &other) {
+    root = copy_at(other.root);
+    size = other.size;
+    slab = nullptr;
+    slab_len = 0;
+    STAT(st.allocated += (long long)size * sizeof(Node<T>));
+  }
+  AVL &operator=(const AVL &) = delete;
+
+  ~AVL() {
+    free_all(root);
+    if (slab != nullptr) {
+      std::destroy_n(slab, slab_len);
+      ::operator delete(slab);
+    }
+  }
+
+  // builds the tree out of n keys that are already sorted and unique, in O(n)
+  // and with all the nodes next to each other in memory. the keys get moved
+  // out of the array. only works on an empty tree
+  void build_sorted(T *keys, int n) {
+    if (root != nullptr) {
+      throw std::runtime_error("build_sorted needs an empty tree");
+    }
+    if (n <= 0) {
+      return;
+    }
+    slab = static_cast<Node<T> *>(::operator new(sizeof(Node<T>) * n));
+    std::uninitialized_default_construct_n(slab, n);
+    slab_len = n;
+    for (int i = 0; i < n; i++) {
+      slab[i].key = std::move(keys[i]);
+    }
+    root = link_sorted(0, n - 1);
+    size = n;
+    STAT(st.allocated += (long long)n * sizeof(Node<T>); st.inserts += n;
+         st.max_height = std::max(st.max_height, getHeight(root)));
   }
 
   int get_size() { return size; }
   T *insert(T val) {
     T *inserted_at = nullptr;
     root = insert_at(root, val, inserted_at);
+    STAT(++st.inserts;
+         st.max_height = std::max(st.max_height, getHeight(root)));
     return inserted_at;
   }
   void remove(T val) {
     bool deleted = false;
     root = delete_at(root, val, deleted);
+    STAT(++st.removes);
   }
   T *find(T val) { return find_at(root, val); }
+
+  // finds keys[i] for every i and puts what it found in results[i]. a plain
+  // find has to wait on every node on the way down before the next find can
+  // start. here a group of keys walks down together, one level per round, and
+  // each key's next node is prefetched while the others are compared, so the
+  // cache misses of the whole group overlap.
+  // K is whatever the key half of T compares against, string_view for strings
+  template <typename K>
+  void find_batch(std::span<const K> keys, std::span<T *> results) {
+    const int GROUP = 16;
+    Node<T> *at[GROUP];
+    STAT(int seen[GROUP]);
+    for (size_t base = 0; base < keys.size(); base += GROUP) {
+      int n = (int)std::min<size_t>(GROUP, keys.size() - base);
+      int walking = 0;
+      for (int i = 0; i < n; i++) {
+        at[i] = root;
+        results[base + i] = nullptr;
+        walking += root != nullptr;
+        STAT(++st.lookups; seen[i] = 0);
+      }
+      while (walking > 0) {
+        walking = 0;
+        for (int i = 0; i < n; i++) {
+          Node<T> *iter = at[i];
+          if (iter == nullptr) {
+            continue;
+          }
+          STAT(++seen[i]; ++st.comparisons);
+          auto order = iter->key.first <=> keys[base + i];
+          if (order == 0) {
+            results[base + i] = &iter->key;
+            at[i] = nullptr;
+          } else {
+            at[i] = order < 0 ? iter->right : iter->left;
+          }
+          if (at[i] != nullptr) {
+            __builtin_prefetch(at[i]);
+            walking++;
+          }
+        }
+      }
+      STAT(for (int i = 0; i < n; i++) {
+        ++st.probes[std::min(seen[i], HIST - 1)];
+      });
+    }
+  }
+
+  // calls f on every key in sorted order. f can change the parts of the key
+  // that don't affect ordering but must not insert or remove
+  template <typename F> void for_each(F f) { for_each_at(root, f); }
+
+  MapStats stats() {
+    MapStats s;
+    STAT(s = st; s.counting = true);
+    s.size = size;
+    s.height = getHeight(root);
+    return s;
+  }
+
+  // T has to be a pair, like for find_batch. nodes from build_sorted share
+  // the slab's block, and slab nodes that were removed since count as slack
+  MemoryUsage memory_usage() {
+    MemoryUsage u;
+    long long live_in_slab = 0;
+    std::vector<Node<T> *> todo;
+    if (root != nullptr) {
+      todo.push_back(root);
+    }
+    while (!todo.empty()) {
+      Node<T> *node = todo.back();
+      todo.pop_back();
+      bool shared = in_slab(node);
+      live_in_slab += shared;
+      u.add_entry(node->key, sizeof(Node<T>),
+                  shared ? 0 : allocated_size(node));
+      if (node->left != nullptr) {
+        todo.push_back(node->left);
+      }
+      if (node->right != nullptr) {
+        todo.push_back(node->right);
+      }
+    }
+    if (slab != nullptr) {
+      u.slack += allocated_size(slab) - live_in_slab * sizeof(Node<T>);
+    }
+    return u;
+  }
 };
 
 template <typename K, typename V> class AVLMap {
@@ -295,9 +663,35 @@ public:
   // this hack belongs in AVLMap. 0 value is ignored during find.
   // use V types default initialization (brace init for safe initialization)
   pair<K, V> *find(K k) { return imp.find({k, V{}}); }
+  // see AVL::find_batch. Q can be a std::string_view to skip making a string
+  // per key
+  template <typename Q>
+  void find_batch(std::span<const Q> keys, std::span<pair<K, V> *> results) {
+    imp.find_batch(keys, results);
+  }
   pair<K, V> *insert(K k, V v) { return imp.insert({k, v}); }
   // hack
   void remove(K k) { imp.remove({k, V{}}); }
+  // items have to be sorted by key with no duplicates, see AVL::build_sorted
+  void build_sorted(pair<K, V> *items, int n) { imp.build_sorted(items, n); }
+
+  // f gets a pair<K, V> &, see the engine's for_each
+  template <typename F> void for_each(F f) { imp.for_each(f); }
+
+  MapStats stats() { return imp.stats(); }
+  MemoryUsage memory_usage() { return imp.memory_usage(); }
+};
+
+// how generate picks each next letter
+struct Decoder {
+  enum Mode {
+    SAMPLE, // draw from the counts, like getRandom
+    GREEDY, // always the most common letter
+    TOP_K   // draw from the k most common, counts raised to 1 / temperature
+  };
+  Mode mode = SAMPLE;
+  int k = LENGTH;
+  double temperature = 1;
 };
 
 class CharDistribution {
@@ -305,6 +699,38 @@ private:
   // The problem here is 32 is the ASCII for Space, so we cannot just subtract a
   // 97. We need to account for the space somehow
   std::array<double, LENGTH> occurences{};
+  // set by freeze: the indexes of the letters that can follow, most common
+  // first. anything that changes a count makes it stale again
+  std::array<unsigned char, LENGTH> order{};
+  unsigned char successors = 0;
+  bool frozen = false;
+
+  // one generator per thread, readers of a Versioned model sample at once
+  static std::mt19937 &rng() {
+    thread_local std::random_device rd;
+    thread_local std::mt19937 gen(rd());
+    return gen;
+  }
+
+  static char letter(int i) { return i == 0 ? ' ' : (char)(i + 96); }
+
+  // puts the indexes of the nonzero counts in out, biggest count first (ties
+  // keep alphabetical order) and returns how many there are. at most 27 of
+  // them so insertion sort is plenty
+  int sort_successors(std::array<unsigned char, LENGTH> &out) {
+    int n = 0;
+    for (int i = 0; i < LENGTH; i++) {
+      if (occurences[i] == 0)
+        continue;
+      int at = n++;
+      while (at > 0 && occurences[out[at - 1]] < occurences[i]) {
+        out[at] = out[at - 1];
+        at--;
+      }
+      out[at] = i;
+    }
+    return n;
+  }
 
 public:
   CharDistribution() {}
@@ -324,6 +750,93 @@ public:
   void addLetter(char letter) {
     int y = (letter - 96) < 0 ? 0 : letter - 96;
     ++occurences[y];
+    frozen = false;
+  }
+  void addLetter(char letter, double count) {
+    int y = (letter - 96) < 0 ? 0 : letter - 96;
+    occurences[y] += count;
+    frozen = false;
+  }
+  // takes count back off, never going under 0
+  void removeLetter(char letter, double count = 1) {
+    int y = (letter - 96) < 0 ? 0 : letter - 96;
+    occurences[y] = std::max(0.0, occurences[y] - count);
+    frozen = false;
+  }
+
+  // sorts the successors once so greedy and top k don't have to look at all
+  // 27 counts every step. call it when the counts stop changing
+  void freeze() {
+    successors = sort_successors(order);
+    frozen = true;
+  }
+
+  // most common letter, '-' if there are none
+  char argmax() {
+    if (frozen) {
+      return successors > 0 ? letter(order[0]) : '-';
+    }
+    int best = -1;
+    for (int i = 0; i < LENGTH; i++) {
+      if (occurences[i] > 0 && (best < 0 || occurences[i] > occurences[best]))
+        best = i;
+    }
+    return best < 0 ? '-' : letter(best);
+  }
+
+  char next(const Decoder &how) {
+    if (how.mode == Decoder::GREEDY)
+      return argmax();
+    if (how.mode == Decoder::SAMPLE)
+      return getRandom();
+
+    // top k. use the frozen order when there is one, otherwise sort now
+    std::array<unsigned char, LENGTH> scratch;
+    const std::array<unsigned char, LENGTH> *ranked = &order;
+    int n = successors;
+    if (!frozen) {
+      n = sort_successors(scratch);
+      ranked = &scratch;
+    }
+    n = std::min(n, std::max(how.k, 1));
+    if (n == 0)
+      return '-';
+
+    double weights[LENGTH];
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+      double c = occurences[(*ranked)[i]];
+      weights[i] = how.temperature == 1 ? c : std::pow(c, 1 / how.temperature);
+      sum += weights[i];
+    }
+    std::uniform_real_distribution<> dist(0, sum);
+    double num = dist(rng());
+    for (int i = 0; i < n - 1; i++) {
+      num -= weights[i];
+      if (num < 0)
+        return letter((*ranked)[i]);
+    }
+    return letter((*ranked)[n - 1]);
+  }
+
+  // count for one letter. letters the model can't make have none
+  double count(char letter) {
+    int y = (letter - 96) < 0 ? 0 : letter - 96;
+    return y < LENGTH ? occurences[y] : 0;
+  }
+
+  double total() {
+    double sum = 0;
+    for (const auto &c : occurences) {
+      sum += c;
+    }
+    return sum;
+  }
+
+  void scale(double by) {
+    for (auto &c : occurences) {
+      c *= by;
+    }
   }
 
   char getRandom() {
@@ -331,23 +844,29 @@ public:
     for (const auto &c : occurences) {
       sum += c;
     }
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dist(1, sum);
+    // counts stop being whole numbers once they decay, so pick a real number
+    std::uniform_real_distribution<> dist(0, sum);
 
-    int num = dist(gen);
+    double num = dist(rng());
+    int last = -1;
 
     for (int i = 0; i < occurences.size(); i++) {
       if (occurences[i] == 0)
         continue;
       // for each number of occurences
+      last = i;
       num -= occurences[i];
-      if (num <= 0) {
+      if (num < 0) {
         if (i == 0)
           return ' ';
         return (char)(i + 96);
       }
     }
+    // rounding can land us here, hand back the last letter that was possible
+    if (last == 0)
+      return ' ';
+    if (last > 0)
+      return (char)(last + 96);
     // this will never happen, theoretically
     return '-';
   }
@@ -374,6 +893,264 @@ public:
   std::array<double, LENGTH> getOccurences() { return occurences; }
 };
 
+// what scoring held-out text adds up to. log likelihoods are natural logs
+struct Score {
+  long long letters = 0;
+  long long unseen = 0; // letters whose context the model never saw
+  double log_likelihood = 0;
+  double seen_log_likelihood = 0; // only over letters with a known context
+
+  void add(const Score &other) {
+    letters += other.letters;
+    unseen += other.unseen;
+    log_likelihood += other.log_likelihood;
+    seen_log_likelihood += other.seen_log_likelihood;
+  }
+
+  void report(std::ostream &out) const {
+    double per = letters ? log_likelihood / letters : 0;
+    long long seen = letters - unseen;
+    double seen_per = seen ? seen_log_likelihood / seen : 0;
+    out << "scored " << letters << " letters\n"
+        << "  log likelihood per letter: " << per << " nats ("
+        << -per / std::log(2.0) << " bits)\n"
+        << "  perplexity: " << std::exp(-per) << "\n"
+        << "  unseen contexts: " << (letters ? 100.0 * unseen / letters : 0)
+        << "% of letters\n"
+        << "  perplexity over seen contexts: " << std::exp(-seen_per)
+        << std::endl;
+  }
+};
+
+// freezes every distribution in map, see CharDistribution::freeze
+template <typename Map> void freeze(Map *map) {
+  map->for_each([](auto &p) { p.second.freeze(); });
+}
+
+// keeps a model up to date while the corpus keeps growing, so nothing has to
+// be rebuilt from scratch. ingest adds the windows a new chunk makes, including
+// the ones that straddle the end of the last chunk. chunks are text that went
+// through preprocess_input already (no newlines).
+//
+// to drop old text there are two modes:
+//  - retire takes back the windows an old chunk added, so the model covers a
+//    sliding window of the text. chunks have to be retired in the order they
+//    came in, but they don't have to be cut in the same places.
+//  - decay makes every later chunk count for more than the ones before it,
+//    which is the same as old counts fading out. counts are kept scaled up and
+//    only brought back down every so often, which is also when faded out
+//    contexts get removed.
+template <typename Map> class Ingestor {
+private:
+  Map *map;
+  int window_size;
+  std::string ingested; // last window_size chars that went through ingest
+  std::string retired;  // same thing for retire
+  double weight;        // what one occurence is worth right now
+  double factor;        // how much old counts shrink per chunk, 1 is off
+  double min_weight;    // contexts fading below this get removed
+
+  // brings every count back to the scale weight 1 and drops the contexts
+  // that faded out. it's a full walk, but it only happens when weight has
+  // grown by 1 / min_weight
+  void renormalize() {
+    int dead = 0;
+    map->for_each([&](auto &p) {
+      p.second.scale(1 / weight);
+      if (p.second.total() < min_weight) {
+        dead++;
+      }
+    });
+    std::string *doomed = new std::string[dead];
+    int at = 0;
+    map->for_each([&](auto &p) {
+      if (p.second.total() < min_weight) {
+        doomed[at++] = p.first;
+      }
+    });
+    for (int i = 0; i < dead; i++) {
+      map->remove(doomed[i]);
+    }
+    delete[] doomed;
+    weight = 1;
+  }
+
+public:
+  Ingestor(Map *map, int window_size)
+      : map(map), window_size(window_size), weight(1), factor(1),
+        min_weight(1e-3) {}
+
+  // old counts get multiplied by factor (0 < factor <= 1) after every chunk
+  void set_decay(double f, double expire_below = 1e-3) {
+    if (f <= 0 || f > 1) {
+      throw std::runtime_error("Decay factor has to be in (0, 1]");
+    }
+    factor = f;
+    min_weight = expire_below;
+  }
+
+  void ingest(const std::string &chunk) {
+    std::string str = ingested + chunk;
+    for (int i = window_size; i < str.length(); i += 1) {
+      auto f = map->find(str.substr(i - window_size, window_size));
+      if (f == nullptr) {
+        CharDistribution t;
+        t.addLetter(str[i], weight);
+        map->insert(str.substr(i - window_size, window_size), t);
+      } else {
+        f->second.addLetter(str[i], weight);
+      }
+    }
+    ingested = str.substr(str.length() - std::min<size_t>(str.length(),
+                                                          window_size));
+
+    if (factor < 1) {
+      weight /= factor;
+      if (weight > 1 / min_weight) {
+        renormalize();
+      }
+    }
+  }
+
+  void retire(const std::string &chunk) {
+    if (factor < 1) {
+      throw std::runtime_error("Can't retire text while decay is on");
+    }
+    std::string str = retired + chunk;
+    for (int i = window_size; i < str.length(); i += 1) {
+      std::string window = str.substr(i - window_size, window_size);
+      auto f = map->find(window);
+      if (f == nullptr) {
+        throw std::runtime_error("Retired text was never ingested");
+      }
+      f->second.removeLetter(str[i]);
+      if (f->second.total() <= 0) {
+        map->remove(window);
+      }
+    }
+    retired = str.substr(str.length() - std::min<size_t>(str.length(),
+                                                         window_size));
+  }
+};
+
+// lets readers keep generating while one writer feeds new text into the next
+// version of the model. the writer works on its own draft, and publish() hands
+// readers a copy of it with one atomic swap. readers just grab the current
+// version and use it with no locks, and nobody ever changes it under them.
+//
+// old versions are freed with epochs: a reader notes the epoch it started in,
+// and a version that was swapped out in epoch e gets freed once no reader
+// from epoch e or earlier is still around. readers that started later can't
+// have seen it
+template <typename Map> class Versioned {
+private:
+  // how many readers can be inside at once. more than that just wait a bit
+  static const int READERS = 64;
+
+  struct Retired {
+    Map *map;
+    long long epoch;
+    Retired *next;
+  };
+
+  std::atomic<Map *> current;
+  std::atomic<long long> epoch;
+  // the epoch each reader started in, 0 for a free slot
+  std::atomic<long long> readers[READERS];
+  Retired *retired; // only the writer touches this
+  Map *draft;
+  Ingestor<Map> writer;
+
+  int enter() {
+    while (true) {
+      long long now = epoch.load();
+      for (int i = 0; i < READERS; i++) {
+        long long free_slot = 0;
+        if (readers[i].compare_exchange_strong(free_slot, now)) {
+          return i;
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  void leave(int slot) { readers[slot].store(0); }
+
+  // frees the old versions no reader can still be looking at
+  void reclaim() {
+    long long oldest = epoch.load();
+    for (int i = 0; i < READERS; i++) {
+      long long e = readers[i].load();
+      if (e != 0 && e < oldest) {
+        oldest = e;
+      }
+    }
+    Retired **at = &retired;
+    while (*at != nullptr) {
+      Retired *r = *at;
+      if (r->epoch < oldest) {
+        *at = r->next;
+        delete r->map;
+        delete r;
+      } else {
+        at = &r->next;
+      }
+    }
+  }
+
+public:
+  // keeps one version alive for as long as it's in scope
+  class Snapshot {
+  private:
+    Versioned *owner;
+    int slot;
+    Map *map;
+
+  public:
+    Snapshot(Versioned &v) : owner(&v) {
+      slot = v.enter();
+      map = v.current.load();
+    }
+    ~Snapshot() { owner->leave(slot); }
+
+    Map *get() { return map; }
+    Map *operator->() { return map; }
+  };
+
+  // takes over map, which becomes both the first version and the draft
+  Versioned(Map *map, int window_size)
+      : current(new Map(*map)), epoch(1), retired(nullptr), draft(map),
+        writer(map, window_size) {
+    for (int i = 0; i < READERS; i++) {
+      readers[i].store(0);
+    }
+  }
+
+  // there can't be any readers left when this runs
+  ~Versioned() {
+    while (retired != nullptr) {
+      Retired *r = retired;
+      retired = r->next;
+      delete r->map;
+      delete r;
+    }
+    delete current.load();
+    delete draft;
+  }
+
+  // the writer side. changes made through here only show up after publish
+  Ingestor<Map> &edit() { return writer; }
+
+  // versions are frozen before readers get them, nothing changes them after
+  void publish() {
+    Map *next = new Map(*draft);
+    freeze(next);
+    Map *old = current.exchange(next);
+    retired = new Retired{old, epoch.fetch_add(1), retired};
+    reclaim();
+  }
+};
+
 } // namespace m
 
 m::AVLMap<std::string, m::CharDistribution> *read_input(std::ifstream &in,
@@ -402,6 +1179,154 @@ m::AVLMap<std::string, m::CharDistribution> *read_input(std::ifstream &in,
   return map;
 }
 
+// lsd radix sort of keys[0..n) that drags pos along with it. 8 bits a pass,
+// and passes stop once the rest of the bits are 0 for every key
+void radix_sort(uint64_t *keys, int *pos, int n) {
+  uint64_t biggest = 0;
+  for (int i = 0; i < n; i++) {
+    biggest = std::max(biggest, keys[i]);
+  }
+
+  uint64_t *key_buf = new uint64_t[n];
+  int *pos_buf = new int[n];
+  uint64_t *from_keys = keys, *to_keys = key_buf;
+  int *from_pos = pos, *to_pos = pos_buf;
+
+  for (int shift = 0; shift < 64 && (biggest >> shift) != 0; shift += 8) {
+    int count[257] = {};
+    for (int i = 0; i < n; i++) {
+      count[((from_keys[i] >> shift) & 0xff) + 1]++;
+    }
+    for (int b = 0; b < 256; b++) {
+      count[b + 1] += count[b];
+    }
+    for (int i = 0; i < n; i++) {
+      int at = count[(from_keys[i] >> shift) & 0xff]++;
+      to_keys[at] = from_keys[i];
+      to_pos[at] = from_pos[i];
+    }
+    std::swap(from_keys, to_keys);
+    std::swap(from_pos, to_pos);
+  }
+
+  // odd number of passes means the answer is sitting in the scratch arrays
+  if (from_keys != keys) {
+    std::copy(from_keys, from_keys + n, keys);
+    std::copy(from_pos, from_pos + n, pos);
+  }
+  delete[] key_buf;
+  delete[] pos_buf;
+}
+
+// sorts the window start positions in pos by the window_size characters that
+// start there. plain lsd string radix sort, one counting sort per column from
+// the last character to the first. used when the windows can't be packed
+void radix_sort_windows(const std::string &str, int *pos, int n,
+                        int window_size) {
+  int *buf = new int[n];
+  for (int d = window_size - 1; d >= 0; d--) {
+    int count[257] = {};
+    for (int i = 0; i < n; i++) {
+      count[(unsigned char)str[pos[i] + d] + 1]++;
+    }
+    for (int b = 0; b < 256; b++) {
+      count[b + 1] += count[b];
+    }
+    for (int i = 0; i < n; i++) {
+      buf[count[(unsigned char)str[pos[i] + d]]++] = pos[i];
+    }
+    std::copy(buf, buf + n, pos);
+  }
+  delete[] buf;
+}
+
+// offline version of read_input for a corpus that doesn't change. instead of
+// one insert per window it sorts every window, squashes equal ones into a
+// single CharDistribution and builds the tree from the sorted run in one go
+m::AVLMap<std::string, m::CharDistribution> *
+read_input_sorted(std::ifstream &in, int window_size) {
+  m::AVLMap<std::string, m::CharDistribution> *map =
+      new m::AVLMap<std::string, m::CharDistribution>();
+
+  std::string str;
+  getline(in, str);
+
+  int n = (int)str.length() - window_size;
+  if (n <= 0 || window_size <= 0) {
+    return map;
+  }
+
+  int *pos = new int[n];
+  for (int i = 0; i < n; i++) {
+    pos[i] = i;
+  }
+
+  // windows of spaces and lowercase letters pack into a base 27 number as long
+  // as 27^window_size fits in 64 bits, and the numbers sort in the same order
+  // as the strings because space comes before 'a'
+  bool packable = window_size <= 13;
+  for (char c : str) {
+    if (c != ' ' && (c < 'a' || c > 'z')) {
+      packable = false;
+      break;
+    }
+  }
+
+  uint64_t *keys = nullptr;
+  if (packable) {
+    keys = new uint64_t[n];
+    uint64_t top = 1; // 27^(window_size - 1)
+    for (int d = 1; d < window_size; d++) {
+      top *= 27;
+    }
+    uint64_t key = 0;
+    for (int d = 0; d < window_size; d++) {
+      key = key * 27 + (str[d] == ' ' ? 0 : str[d] - 96);
+    }
+    for (int i = 0; i < n; i++) {
+      keys[i] = key;
+      // roll the window one character over
+      int out = str[i] == ' ' ? 0 : str[i] - 96;
+      int in = str[i + window_size] == ' ' ? 0 : str[i + window_size] - 96;
+      key = (key - out * top) * 27 + in;
+    }
+    radix_sort(keys, pos, n);
+  } else {
+    radix_sort_windows(str, pos, n, window_size);
+  }
+
+  // equal windows are next to each other now, so count the runs
+  auto same = [&](int a, int b) {
+    if (packable) {
+      return keys[a] == keys[b];
+    }
+    return str.compare(pos[a], window_size, str, pos[b], window_size) == 0;
+  };
+  int runs = 0;
+  for (int i = 0; i < n; i++) {
+    if (i == 0 || !same(i - 1, i)) {
+      runs++;
+    }
+  }
+
+  m::pair<std::string, m::CharDistribution> *items =
+      new m::pair<std::string, m::CharDistribution>[runs];
+  int at = -1;
+  for (int i = 0; i < n; i++) {
+    if (i == 0 || !same(i - 1, i)) {
+      at++;
+      items[at].first = str.substr(pos[i], window_size);
+    }
+    items[at].second.addLetter(str[pos[i] + window_size]);
+  }
+  map->build_sorted(items, runs);
+
+  delete[] items;
+  delete[] keys;
+  delete[] pos;
+  return map;
+}
+
 void preprocess_input(std::ifstream &in) {
   std::ofstream out;
   out.open("preprocessed");
@@ -413,19 +1338,15 @@ void preprocess_input(std::ifstream &in) {
   }
 }
 
-std::string generate_output(std::ifstream &in,
-                            m::AVLMap<std::string, m::CharDistribution> *map,
-                            int window_size, int output_size) {
-  in.clear();
-  in.seekg(0);
-
-  std::string line;
-  getline(in, line);
-  std::string starting_substr = line.substr(0, window_size);
-
+// keeps adding letters to start until it's output_size long. Map is anything
+// with a find that hands back a pair with a CharDistribution in it
+template <typename Map>
+std::string generate_from(Map *map, std::string start, int window_size,
+                          int output_size,
+                          const m::Decoder &how = m::Decoder()) {
   // this is very inefficient, but no premade data structures so
   // no stringstream :(
-  std::string ret = starting_substr;
+  std::string ret = start;
 
   while (ret.size() <= output_size) {
     auto p = map->find(ret.substr(ret.size() - window_size, window_size));
@@ -433,13 +1354,473 @@ std::string generate_output(std::ifstream &in,
       std::cerr << "EARLY EXIT, NO SUBSTR FOUND HERE" << std::endl;
       return ret;
     } else {
-      ret += p->second.getRandom();
+      ret += p->second.next(how);
     }
   }
   return ret;
 }
 
-int main() {
+// looks up every window, with the map's find_batch when it has one
+template <typename Map, typename Entry>
+void find_windows(Map *map, std::span<const std::string_view> windows,
+                  std::span<Entry *> found) {
+  if constexpr (requires { map->find_batch(windows, found); }) {
+    map->find_batch(windows, found);
+  } else {
+    for (size_t i = 0; i < windows.size(); i++) {
+      found[i] = map->find(windows[i]);
+    }
+  }
+}
+
+// scores the letters of text from `from` up to `to`, each one against the
+// window_size letters before it. counts get add one smoothing so a letter the
+// context never saw doesn't make the whole thing -inf, and a context the model
+// never saw counts as every letter being equally likely
+template <typename Map>
+m::Score score_range(Map *map, std::string_view text, size_t from, size_t to,
+                     int window_size) {
+  using Entry = std::remove_pointer_t<decltype(map->find({}))>;
+  const int BLOCK = 64;
+  std::string_view windows[BLOCK];
+  Entry *found[BLOCK];
+  const double uniform = std::log(1.0 / LENGTH);
+
+  m::Score score;
+  for (size_t i = from; i < to; i += BLOCK) {
+    int n = (int)std::min<size_t>(BLOCK, to - i);
+    for (int j = 0; j < n; j++) {
+      windows[j] = text.substr(i + j - window_size, window_size);
+    }
+    find_windows(map, std::span<const std::string_view>(windows, n),
+                 std::span(found, n));
+
+    for (int j = 0; j < n; j++) {
+      if (found[j] == nullptr) {
+        score.unseen++;
+        score.log_likelihood += uniform;
+        continue;
+      }
+      m::CharDistribution &d = found[j]->second;
+      double p = std::log((d.count(text[i + j]) + 1) / (d.total() + LENGTH));
+      score.log_likelihood += p;
+      score.seen_log_likelihood += p;
+    }
+    score.letters += n;
+  }
+  return score;
+}
+
+// streams the file at path through map a chunk at a time, so it can be much
+// bigger than memory. the next chunk is read while this one is scored, split
+// between threads. each chunk starts with the last window_size letters of
+// the one before so no letter loses its context. newlines become spaces, the
+// same as preprocess_input
+template <typename Map>
+m::Score score_file(Map *map, const char *path, int window_size,
+                    int threads) {
+  const size_t CHUNK = 1 << 24;
+  std::ifstream in(path, std::ios::binary);
+  if (!in.is_open()) {
+    throw std::runtime_error("Can't open " + std::string(path));
+  }
+
+  auto fill = [&](std::string &buf, const std::string &prev) {
+    size_t keep = std::min<size_t>(window_size, prev.size());
+    buf.assign(prev, prev.size() - keep, keep);
+    buf.resize(keep + CHUNK);
+    in.read(&buf[keep], CHUNK);
+    buf.resize(keep + in.gcount());
+    std::replace(buf.begin() + keep, buf.end(), '\n', ' ');
+    return in.gcount() > 0;
+  };
+
+  std::string cur, next;
+  bool more = fill(cur, "");
+  m::Score total;
+  std::vector<m::Score> parts(threads);
+  while (more) {
+    std::thread reader([&]() { more = fill(next, cur); });
+
+    // every chunk starts window_size letters into its buffer, either because
+    // that's the carried over context or because it's the start of the file
+    size_t from = window_size, to = cur.size();
+    if (from < to) {
+      size_t step = (to - from + threads - 1) / threads;
+      std::vector<std::thread> workers;
+      for (int t = 0; t < threads; t++) {
+        size_t a = std::min(to, from + t * step);
+        size_t b = std::min(to, a + step);
+        workers.emplace_back([&, t, a, b]() {
+          parts[t] = score_range(map, cur, a, b, window_size);
+        });
+      }
+      for (int t = 0; t < threads; t++) {
+        workers[t].join();
+        total.add(parts[t]);
+      }
+    }
+
+    reader.join();
+    std::swap(cur, next);
+  }
+  return total;
+}
+
+// a model as a markov chain over its contexts, see to_chain
+struct Chain {
+  std::vector<std::string> contexts; // row and column i are contexts[i]
+  SparseMatrix transitions;
+  // chance that a step from each context picks a letter that leads to a
+  // context the model doesn't have, which is where generate stops early. 1
+  // means the context is a dead end
+  std::vector<double> lost;
+};
+
+// the chance of going from a context to the one it turns into after the next
+// letter (drop the first letter, add the new one on the end) is that letter's
+// share of the context's counts. rows are numbered in for_each order
+template <typename Map> Chain to_chain(Map *map) {
+  std::vector<std::string> contexts;
+  std::vector<m::CharDistribution *> counts;
+  m::AVLMap<std::string, int> index;
+  map->for_each([&](auto &p) {
+    index.insert(p.first, (int)contexts.size());
+    contexts.push_back(p.first);
+    counts.push_back(&p.second);
+  });
+
+  const std::string_view letters = " abcdefghijklmnopqrstuvwxyz";
+  std::vector<Node> entries;
+  std::vector<double> lost(contexts.size(), 0);
+  for (size_t i = 0; i < contexts.size(); i++) {
+    double total = counts[i]->total();
+    std::string next = contexts[i].substr(1) + ' ';
+    for (char c : letters) {
+      double count = counts[i]->count(c);
+      if (count == 0) {
+        continue;
+      }
+      next.back() = c;
+      auto to = index.find(next);
+      if (to == nullptr) {
+        lost[i] += count / total;
+      } else {
+        entries.emplace_back((int)i, to->second, count / total);
+      }
+    }
+  }
+  int n = (int)contexts.size();
+  return Chain{std::move(contexts), SparseMatrix(n, n, entries),
+               std::move(lost)};
+}
+
+// prints the k most likely contexts under dist, most likely first
+void print_top(std::ostream &out, const Chain &chain,
+               const std::vector<double> &dist, int k) {
+  std::vector<int> order(dist.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = (int)i;
+  }
+  k = std::min<int>(k, order.size());
+  std::partial_sort(order.begin(), order.begin() + k, order.end(),
+                    [&](int a, int b) { return dist[a] > dist[b]; });
+  for (int i = 0; i < k; i++) {
+    out << "    " << dist[order[i]] << " \"" << chain.contexts[order[i]]
+        << "\"\n";
+  }
+}
+
+// what the chain looks like: its dead ends, where walks spend their time in
+// the long run (good seeds) and where a walk from the corpus start is after
+// steps letters
+template <typename Map>
+void report_chain(std::ostream &out, Map *map, const std::string &start,
+                  int steps, int threads) {
+  Chain chain = to_chain(map);
+  int n = chain.transitions.rows();
+  int dead = 0, leaky = 0;
+  for (double l : chain.lost) {
+    dead += l >= 1;
+    leaky += l > 0 && l < 1;
+  }
+  out << "chain over " << n << " contexts, "
+      << chain.transitions.nonzeros() << " transitions\n"
+      << "  " << dead << " dead ends, " << leaky
+      << " more contexts that sometimes lead to one\n"
+      << "  most likely contexts in the long run:\n";
+  print_top(out, chain, chain.transitions.stationary(threads), 10);
+
+  std::vector<double> from(n, 0);
+  for (int i = 0; i < n; i++) {
+    from[i] = chain.contexts[i] == start;
+  }
+  std::vector<double> after = chain.transitions.propagate(from, steps, threads);
+  double kept = 0;
+  for (double p : after) {
+    kept += p;
+  }
+  out << "  " << steps << " letters after \"" << start << "\", "
+      << 1 - kept << " of walks have hit a dead end. most likely contexts:\n";
+  print_top(out, chain, after, 5);
+  out << std::flush;
+}
+
+// starts from the beginning of the corpus
+template <typename Map>
+std::string generate_output(std::ifstream &in, Map *map, int window_size,
+                            int output_size,
+                            const m::Decoder &how = m::Decoder()) {
+  in.clear();
+  in.seekg(0);
+
+  std::string line;
+  getline(in, line);
+  return generate_from(map, line.substr(0, window_size), window_size,
+                       output_size, how);
+}
+
+// feeds the corpus in one chunk at a time on a writer thread, publishing a new
+// version after each chunk, while this thread keeps generating from whatever
+// version is out at the time
+template <typename Map>
+void run_live(std::ifstream &in, int window_size, int output_size) {
+  in.clear();
+  in.seekg(0);
+  std::string line;
+  getline(in, line);
+
+  const int chunks = 8;
+  size_t chunk = line.length() / chunks + 1;
+  m::Versioned<Map> model(new Map(), window_size);
+  std::atomic<bool> done(false);
+
+  std::thread writer([&]() {
+    for (size_t at = 0; at < line.length(); at += chunk) {
+      model.edit().ingest(line.substr(at, chunk));
+      model.publish();
+    }
+    done = true;
+  });
+
+  std::string start = line.substr(0, window_size);
+  while (!done) {
+    typename m::Versioned<Map>::Snapshot snap(model);
+    if (snap->size() > 0) {
+      std::cout << snap->size() << " contexts: "
+                << generate_from(snap.get(), start, window_size, output_size)
+                << std::endl;
+    }
+  }
+  writer.join();
+}
+
+// reads one line off fd. pending holds whatever came in past the last line,
+// so a client can send a pile of requests at once and they get picked off
+// one by one
+bool read_line(int fd, std::string &pending, std::string &line) {
+  while (true) {
+    size_t nl = pending.find('\n');
+    if (nl != std::string::npos) {
+      line = pending.substr(0, nl);
+      pending.erase(0, nl + 1);
+      return true;
+    }
+    char buf[4096];
+    ssize_t got = read(fd, buf, sizeof(buf));
+    if (got <= 0) {
+      // last line without a newline still counts
+      line = pending;
+      pending.clear();
+      return !line.empty();
+    }
+    pending.append(buf, got);
+  }
+}
+
+bool write_all(int fd, const std::string &str) {
+  size_t done = 0;
+  while (done < str.length()) {
+    ssize_t put = write(fd, str.data() + done, str.length() - done);
+    if (put <= 0) {
+      return false;
+    }
+    done += put;
+  }
+  return true;
+}
+
+// one request, one line back:
+//   gen <n> [seed]   generate until the text is n long, starting from seed
+//                    (or the start of the corpus). ok <text>
+//   greedy <n> [seed]            same, always taking the most common letter
+//   topk <k> <temp> <n> [seed]   same, sampling the k most common letters
+//                                with counts raised to 1 / temp
+//   ingest <text>    add text to the model, readers see it right after. ok
+//   quit             hang up
+// anything wrong comes back as err <reason>
+template <typename Map>
+std::string answer(m::Versioned<Map> &model, std::mutex &writing,
+                   const std::string &request, const std::string &start,
+                   int window_size) {
+  size_t sp = request.find(' ');
+  std::string cmd = request.substr(0, sp);
+  std::string rest = sp == std::string::npos ? "" : request.substr(sp + 1);
+
+  m::Decoder how;
+  if (cmd == "greedy") {
+    how.mode = m::Decoder::GREEDY;
+    cmd = "gen";
+  } else if (cmd == "topk") {
+    how.mode = m::Decoder::TOP_K;
+    try {
+      size_t used;
+      how.k = std::stoi(rest, &used);
+      rest = rest.substr(used);
+      how.temperature = std::stod(rest, &used);
+      rest = rest.substr(used);
+    } catch (const std::exception &) {
+      return "err topk needs k and a temperature";
+    }
+    if (how.temperature <= 0) {
+      return "err temperature has to be above 0";
+    }
+    rest.erase(0, rest.find_first_not_of(' '));
+    cmd = "gen";
+  }
+
+  if (cmd == "gen") {
+    sp = rest.find(' ');
+    int n;
+    try {
+      n = std::stoi(rest.substr(0, sp));
+    } catch (const std::exception &) {
+      return "err gen needs a length";
+    }
+    std::string seed = sp == std::string::npos ? start : rest.substr(sp + 1);
+    if (seed.length() < window_size) {
+      return "err seed is shorter than the window";
+    }
+    typename m::Versioned<Map>::Snapshot snap(model);
+    return "ok " + generate_from(snap.get(), seed, window_size, n, how);
+  }
+  if (cmd == "ingest") {
+    // only one writer at a time, readers never wait on this
+    std::lock_guard<std::mutex> lock(writing);
+    model.edit().ingest(rest);
+    model.publish();
+    return "ok";
+  }
+  return "err unknown request " + cmd;
+}
+
+// answers requests from in_fd on out_fd until the other end hangs up. every
+// answer is written out as soon as it's ready
+template <typename Map>
+void serve_fd(int in_fd, int out_fd, m::Versioned<Map> &model,
+              std::mutex &writing, const std::string &start,
+              int window_size) {
+  std::string pending, request;
+  while (read_line(in_fd, pending, request)) {
+    if (request == "quit") {
+      return;
+    }
+    if (request.empty()) {
+      continue;
+    }
+    std::string reply = answer(model, writing, request, start, window_size);
+    if (!write_all(out_fd, reply + "\n")) {
+      return;
+    }
+  }
+}
+
+// keeps map in memory and answers requests, from stdin or, given a path, from
+// every client of a unix socket there (one thread each)
+template <typename Map>
+void serve(Map *map, std::ifstream &in, int window_size,
+           const char *socket_path) {
+  in.clear();
+  in.seekg(0);
+  std::string line;
+  getline(in, line);
+  std::string start = line.substr(0, window_size);
+
+  m::Versioned<Map> model(map, window_size);
+  std::mutex writing;
+  // a client hanging up mid answer shouldn't take the server down
+  signal(SIGPIPE, SIG_IGN);
+
+  if (socket_path == nullptr) {
+    std::cerr << "ready" << std::endl;
+    serve_fd(STDIN_FILENO, STDOUT_FILENO, model, writing, start, window_size);
+    return;
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  unlink(socket_path);
+  if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 64) < 0) {
+    throw std::runtime_error("Can't listen on " + std::string(socket_path));
+  }
+  std::cerr << "ready on " << socket_path << std::endl;
+
+  while (true) {
+    int client = accept(listener, nullptr, nullptr);
+    if (client < 0) {
+      continue;
+    }
+    std::thread([&, client]() {
+      serve_fd(client, client, model, writing, start, window_size);
+      close(client);
+    }).detach();
+  }
+}
+
+// picks --greedy, --top-k <k> and --temperature <t> out of the arguments.
+// --temperature on its own means top k over every letter
+m::Decoder read_decoder(int argc, char **argv) {
+  m::Decoder how;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--greedy") {
+      how.mode = m::Decoder::GREEDY;
+    } else if (arg == "--top-k" && i + 1 < argc) {
+      how.mode = m::Decoder::TOP_K;
+      how.k = std::stoi(argv[++i]);
+    } else if (arg == "--temperature" && i + 1 < argc) {
+      if (how.mode == m::Decoder::SAMPLE) {
+        how.mode = m::Decoder::TOP_K;
+      }
+      how.temperature = std::stod(argv[++i]);
+    }
+  }
+  if (how.temperature <= 0) {
+    throw std::runtime_error("Temperature has to be above 0");
+  }
+  return how;
+}
+
+int main(int argc, char **argv) {
+  // --greedy, --top-k <k> and --temperature <t> change how letters are picked
+  m::Decoder how = read_decoder(argc, argv);
+  // ./avl live keeps generating while the model is still being fed
+  bool live = argc > 1 && std::string(argv[1]) == "live";
+  // ./avl serve <window size> [socket path] builds the model once and then
+  // answers requests, see serve
+  bool serving = argc > 2 && std::string(argv[1]) == "serve";
+  // ./avl score <window size> <file> [threads] reports how well the model
+  // predicts the text in file, see score_file
+  bool scoring = argc > 3 && std::string(argv[1]) == "score";
+  // ./avl memory <window size> builds the model and prints where its
+  // memory went, see MemoryUsage
+  bool measuring = argc > 2 && std::string(argv[1]) == "memory";
+  // ./avl chain <window size> [steps] [threads] looks at the model as a
+  // markov chain, see report_chain
+  bool chaining = argc > 2 && std::string(argv[1]) == "chain";
 
   std::ifstream input;
   input.open("merchant.txt");
@@ -450,6 +1831,43 @@ int main() {
   }
   input.open("preprocessed");
 
+  if (chaining) {
+    int window_size = std::stoi(argv[2]);
+    int steps = argc > 3 ? std::stoi(argv[3]) : 100;
+    int threads = argc > 4 ? std::stoi(argv[4])
+                           : std::max(1u, std::thread::hardware_concurrency());
+    std::string line;
+    getline(input, line);
+    input.clear();
+    input.seekg(0);
+    report_chain(std::cout, read_input_sorted(input, window_size),
+                 line.substr(0, window_size), steps, threads);
+    return 0;
+  }
+
+  if (measuring) {
+    int window_size = std::stoi(argv[2]);
+    read_input_sorted(input, window_size)->memory_usage().to_json(std::cout);
+    std::cout << std::endl;
+    return 0;
+  }
+
+  if (scoring) {
+    int window_size = std::stoi(argv[2]);
+    int threads = argc > 4 ? std::stoi(argv[4])
+                           : std::max(1u, std::thread::hardware_concurrency());
+    const auto model = read_input_sorted(input, window_size);
+    score_file(model, argv[3], window_size, threads).report(std::cout);
+    return 0;
+  }
+
+  if (serving) {
+    int window_size = std::stoi(argv[2]);
+    serve(read_input_sorted(input, window_size), input, window_size,
+          argc > 3 ? argv[3] : nullptr);
+    return 0;
+  }
+
   std::cout << "Welcome to Anish's bootleg RNN!" << std::endl;
   std::cout << "Please enter a window size: " << std::endl;
 
@@ -461,12 +1879,30 @@ int main() {
   int output_size;
   std::cin >> output_size;
 
-  // this returns an AVLMap
-  const auto ret = read_input(input, window_size);
-  const std::string out = generate_output(input, ret, window_size, output_size);
+  if (live) {
+    run_live<m::AVLMap<std::string, m::CharDistribution>>(input, window_size,
+                                                     output_size);
+    input.close();
+    return 0;
+  }
+
+  // this returns an AVLMap. the corpus is fixed so build it sorted instead of
+  // inserting window by window, read_input makes the same map
+  const auto ret = read_input_sorted(input, window_size);
+  // sort every context's successors once instead of on every step
+  if (how.mode != m::Decoder::SAMPLE) {
+    m::freeze(ret);
+  }
+  const std::string out =
+      generate_output(input, ret, window_size, output_size, how);
 
   std::cout << out << std::endl;
 
+#ifdef MAP_STATS
+  ret->stats().to_json(std::cerr);
+  std::cerr << std::endl;
+#endif
+
   input.close();
   return 0;
 }
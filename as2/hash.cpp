@@ -9,20 +9,57 @@
  * AVLMap becomes HashMap (these implementations are exactly the same)
  * main functions and everything else is exactly the same
  *
+ * Engine specific extras added later:
+ *  - hash.cpp: SketchModel, a fixed memory approximate model (./a.out sketch)
+ *  - hash.cpp: windows over 15 chars keep their keys in a KeySlab
+ *
  * Discussed problem statement with Abhishek Amani
  * Code: all me!
  */
+#include "../as1/SparseMatrix.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cctype>
+#include <csignal>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <mutex>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
 #include <random>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
 
 #define LENGTH 27
+// buckets in the probe histogram, the last one catches everything longer
+#define HIST 16
+
+// build with -DMAP_STATS to count what the map engines are doing. with it off
+// every STAT(...) expands to nothing so the normal build doesnt pay for it
+#ifdef MAP_STATS
+#define STAT(...) __VA_ARGS__
+#else
+#define STAT(...)
+#endif
+
 /**
  * use occurs(c) to update.
  * increment a counter for character c every time c occurs
@@ -42,22 +79,141 @@ template <typename K, typename V> struct pair {
   }
 };
 
+// snapshot of the counters a map engine keeps. some fields only make sense for
+// one of the engines (rotations for the AVL, buckets for the hash table), the
+// other one just leaves them at 0
+struct MapStats {
+  bool counting = false; // false when built without MAP_STATS
+  int size = 0;
+  long long lookups = 0;
+  long long comparisons = 0; // key comparisons done by find
+  long long inserts = 0;
+  long long removes = 0;
+  long long rotations = 0;
+  int height = 0;
+  int max_height = 0;
+  int buckets = 0;
+  int used_buckets = 0;
+  int longest_chain = 0;
+  long long allocated = 0; // bytes of nodes and bucket arrays
+  long long freed = 0;
+  // probes[i] is how many finds looked at i nodes before they were done
+  std::array<long long, HIST> probes{};
+
+  void to_json(std::ostream &out) const {
+    out << "{\"counting\": " << (counting ? "true" : "false")
+        << ", \"size\": " << size << ", \"lookups\": " << lookups
+        << ", \"comparisons\": " << comparisons
+        << ", \"comparisons_per_lookup\": "
+        << (lookups ? (double)comparisons / lookups : 0.0)
+        << ", \"inserts\": " << inserts << ", \"removes\": " << removes
+        << ", \"rotations\": " << rotations << ", \"height\": " << height
+        << ", \"max_height\": " << max_height << ", \"buckets\": " << buckets
+        << ", \"used_buckets\": " << used_buckets
+        << ", \"longest_chain\": " << longest_chain
+        << ", \"bytes_allocated\": " << allocated
+        << ", \"bytes_freed\": " << freed << ", \"probes\": [";
+    for (int i = 0; i < HIST; i++) {
+      out << (i ? ", " : "") << probes[i];
+    }
+    out << "]}";
+  }
+};
+
+// bytes the block at p takes up in the heap. the allocator can hand out more
+// than was asked for, and glibc keeps a size word in front of every block, the
+// difference from what was asked for is slack
+inline size_t allocated_size(const void *p) {
+#ifdef __APPLE__
+  return malloc_size(p);
+#else
+  return malloc_usable_size(const_cast<void *>(p)) + sizeof(size_t);
+#endif
+}
+
+// where the memory of a map goes, measured by asking the allocator about every
+// block the map owns. see the engines' memory_usage
+struct MemoryUsage {
+  long long contexts = 0;
+  long long node_overhead = 0; // links, heights, stored hashes and padding
+  long long key_inline = 0;    // the key objects inside the nodes
+  long long key_heap = 0;      // blocks the keys point to, 0 for short strings
+  long long value_bytes = 0;
+  long long buckets = 0;
+  long long slack = 0; // handed out by the allocator past what was asked for
+
+  long long total() const {
+    return node_overhead + key_inline + key_heap + value_bytes + buckets +
+           slack;
+  }
+
+  // one entry of a map. block is what the allocator gave its node, 0 when the
+  // node is part of a bigger block that gets counted on its own
+  template <typename K, typename V>
+  void add_entry(const pair<K, V> &entry, size_t node_size, size_t block) {
+    contexts++;
+    key_inline += sizeof(K);
+    value_bytes += sizeof(V);
+    node_overhead += node_size - sizeof(K) - sizeof(V);
+    if (block > 0) {
+      slack += block - node_size;
+    }
+    add_heap(entry.first);
+  }
+
+  // a string keeps short keys in its own bytes, longer ones in a block of
+  // capacity + 1
+  void add_heap(const std::string &key) {
+    const char *at = key.data();
+    const char *self = reinterpret_cast<const char *>(&key);
+    if (at >= self && at < self + sizeof(key)) {
+      return;
+    }
+    size_t asked = key.capacity() + 1;
+    key_heap += asked;
+    slack += allocated_size(at) - asked;
+  }
+  template <typename K> void add_heap(const K &) {}
+
+  void to_json(std::ostream &out) const {
+    auto per = [&](long long bytes) {
+      return contexts ? (double)bytes / contexts : 0.0;
+    };
+    out << "{\"contexts\": " << contexts << ", \"bytes\": " << total()
+        << ", \"node_overhead\": " << node_overhead
+        << ", \"key_inline\": " << key_inline
+        << ", \"key_heap\": " << key_heap
+        << ", \"value_bytes\": " << value_bytes
+        << ", \"buckets\": " << buckets << ", \"slack\": " << slack
+        << ", \"per_context\": {\"bytes\": " << per(total())
+        << ", \"node_overhead\": " << per(node_overhead)
+        << ", \"key_inline\": " << per(key_inline)
+        << ", \"key_heap\": " << per(key_heap)
+        << ", \"value_bytes\": " << per(value_bytes)
+        << ", \"buckets\": " << per(buckets) << ", \"slack\": " << per(slack)
+        << "}}";
+  }
+};
+
 template <typename T> struct Node {
   T key;
   int height;
   Node *left;
   Node *right;
+  uint64_t hash; // full hash of key, set by HashTable
 
   Node(T k) {
     key = k;
     left = nullptr;
     right = nullptr;
     height = 1;
+    hash = 0;
   }
   Node() {
     left = nullptr;
     right = nullptr;
     height = 1;
+    hash = 0;
   }
 
   bool operator<(const Node &other) const { return this->key < other.key; };
@@ -65,30 +221,140 @@ template <typename T> struct Node {
   bool operator==(const Node &other) const { return this->key == other.key; };
 };
 
-template <typename T> class HashTable {
+// the default hash policy for HashTable. wyhash style: eats the key 16 bytes
+// at a time and mixes with a 64x64 -> 128 bit multiply, which is a lot less
+// work than std::hash once windows get long. a policy is anything with
+// uint64_t operator()(std::string_view)
+struct FastHash {
+  static uint64_t mum(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+  }
+  static uint64_t read8(const char *p) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+  }
+  static uint64_t read4(const char *p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+  }
+
+  uint64_t operator()(std::string_view key) const {
+    const uint64_t s0 = 0xa0761d6478bd642fULL, s1 = 0xe7037ed1a0b428dbULL;
+    const char *p = key.data();
+    size_t len = key.size(), left = len;
+    uint64_t h = s0;
+    while (left > 16) {
+      h = mum(read8(p) ^ s1, read8(p + 8) ^ h);
+      p += 16;
+      left -= 16;
+    }
+    // the last 1 to 16 bytes, reads can overlap
+    uint64_t a = 0, b = 0;
+    if (left >= 8) {
+      a = read8(p);
+      b = read8(p + left - 8);
+    } else if (left >= 4) {
+      a = read4(p);
+      b = read4(p + left - 4);
+    } else if (left > 0) {
+      a = ((uint64_t)(unsigned char)p[0] << 16) |
+          ((uint64_t)(unsigned char)p[left / 2] << 8) |
+          (unsigned char)p[left - 1];
+    }
+    return mum(s1 ^ len, mum(a ^ s1, b ^ h));
+  }
+};
+
+// separate chaining with a power of two number of buckets, so picking one is a
+// mask and not a division. every node keeps its key's full hash, so walking a
+// chain only compares keys when the hashes already match, and growing the
+// table never has to hash a key again
+template <typename T, typename Hash = FastHash> class HashTable {
 private:
   int capacity;
   int size;
+  uint64_t mask; // capacity - 1
   Node<T> **arr;
-  int hash(T &val) {
+  Hash hasher;
+#ifdef MAP_STATS
+  MapStats st;
+#endif
+  uint64_t hash(T &val) { return hash_key(val.first); }
+  // K is anything that turns into a string_view
+  template <typename K> uint64_t hash_key(const K &key) {
     // we are just gonna hope and pray that val is a string
     // beacuse that's what this is for
-    std::hash<std::string> st;
-    return st(val.first) % capacity;
+    return hasher(std::string_view(key));
+  }
+
+  // doubles the buckets once there are more entries than buckets
+  void resize() {
+    int new_capacity = capacity * 2;
+    uint64_t new_mask = new_capacity - 1;
+    Node<T> **bigger = new Node<T> *[new_capacity];
+    STAT(st.allocated += new_capacity * sizeof(Node<T> *);
+         st.freed += capacity * sizeof(Node<T> *));
+    for (int i = 0; i < new_capacity; i++) {
+      bigger[i] = nullptr;
+    }
+    for (int i = 0; i < capacity; i++) {
+      Node<T> *entry = arr[i];
+      while (entry != nullptr) {
+        Node<T> *next = entry->right;
+        entry->right = bigger[entry->hash & new_mask];
+        bigger[entry->hash & new_mask] = entry;
+        entry = next;
+      }
+    }
+    delete[] arr;
+    arr = bigger;
+    capacity = new_capacity;
+    mask = new_mask;
   }
-  int resize() {}
 
 public:
+  // cap gets rounded up to a power of two
   HashTable(int cap = 1000) {
-    this->capacity = cap;
+    this->capacity = 1;
+    while (this->capacity < cap) {
+      this->capacity *= 2;
+    }
+    this->mask = capacity - 1;
     this->size = 0;
     this->arr = new Node<T> *[capacity];
+    STAT(st.allocated += capacity * sizeof(Node<T> *));
 
     for (int i = 0; i < capacity; i++) {
       arr[i] = nullptr;
     }
   }
 
+  // deep copy, chains keep their order
+  HashTable(const HashTable &other) {
+    this->capacity = other.capacity;
+    this->mask = other.mask;
+    this->size = other.size;
+    this->hasher = other.hasher;
+    this->arr = new Node<T> *[capacity];
+    STAT(st.allocated += capacity * sizeof(Node<T> *) +
+                         (long long)size * sizeof(Node<T>));
+
+    for (int i = 0; i < capacity; i++) {
+      Node<T> **tail = &arr[i];
+      for (Node<T> *entry = other.arr[i]; entry != nullptr;
+           entry = entry->right) {
+        *tail = new Node<T>(entry->key);
+        (*tail)->hash = entry->hash;
+        tail = &(*tail)->right;
+      }
+      *tail = nullptr;
+    }
+  }
+  HashTable &operator=(const HashTable &) = delete;
+
   ~HashTable() {
     for (int i = 0; i < capacity; i++) {
       Node<T> *entry = arr[i];
@@ -103,71 +369,185 @@ public:
 
   int get_size() { return size; }
   T *find(T key) {
-    int hashVal = hash(key);
-    Node<T> *entry = arr[hashVal];
+    return find_hashed(hash(key), [&](T &other) { return other == key; });
+  }
+
+  // lower level find for keys the table can't hash or compare by itself (see
+  // SlabMap). h is the key's hash and same(entry) says if entry is the one
+  template <typename Eq> T *find_hashed(uint64_t h, Eq same) {
+    Node<T> *entry = arr[h & mask];
+    STAT(++st.lookups; int seen = 0);
 
     while (entry != nullptr) {
-      if (entry->key == key) {
-        return &entry->key;
+      STAT(++seen);
+      if (entry->hash == h) {
+        STAT(++st.comparisons);
+        if (same(entry->key)) {
+          STAT(++st.probes[std::min(seen, HIST - 1)]);
+          return &entry->key;
+        }
       }
       entry = entry->right;
     }
     // didn't exist
+    STAT(++st.probes[std::min(seen, HIST - 1)]);
     return nullptr;
   }
 
+  // finds keys[i] for every i and puts what it found in results[i]. a plain
+  // find has to wait on the bucket and then on every node in the chain before
+  // the next find can start. here a group of keys gets hashed first and all
+  // their buckets prefetched, then all the chain heads, and only then are the
+  // chains walked, so the cache misses of the whole group overlap.
+  // K is whatever the key half of T compares against, string_view for strings
+  template <typename K>
+  void find_batch(std::span<const K> keys, std::span<T *> results) {
+    const int GROUP = 16;
+    uint64_t h[GROUP];
+    for (size_t base = 0; base < keys.size(); base += GROUP) {
+      int n = (int)std::min<size_t>(GROUP, keys.size() - base);
+      for (int i = 0; i < n; i++) {
+        h[i] = hash_key(keys[base + i]);
+        __builtin_prefetch(&arr[h[i] & mask]);
+      }
+      for (int i = 0; i < n; i++) {
+        if (arr[h[i] & mask] != nullptr) {
+          __builtin_prefetch(arr[h[i] & mask]);
+        }
+      }
+      for (int i = 0; i < n; i++) {
+        Node<T> *entry = arr[h[i] & mask];
+        STAT(++st.lookups; int seen = 0);
+        while (entry != nullptr) {
+          STAT(++seen);
+          if (entry->hash == h[i]) {
+            STAT(++st.comparisons);
+            if (entry->key.first == keys[base + i]) {
+              break;
+            }
+          }
+          entry = entry->right;
+        }
+        STAT(++st.probes[std::min(seen, HIST - 1)]);
+        results[base + i] = entry == nullptr ? nullptr : &entry->key;
+      }
+    }
+  }
+
   T *insert(T key) {
-    int hashVal = hash(key);
-    Node<T> *entry = arr[hashVal];
+    uint64_t h = hash(key);
+    Node<T> *entry = arr[h & mask];
     while (entry != nullptr) {
-      if (entry->key == key) {
+      if (entry->hash == h && entry->key == key) {
+        STAT(++st.inserts);
         entry->key = key;
         return &entry->key;
       }
       entry = entry->right;
     }
+    return insert_hashed(h, key);
+  }
 
+  // adds key under hash h without looking for it first, so the caller has to
+  // know it isn't in the table yet
+  T *insert_hashed(uint64_t h, T key) {
+    STAT(++st.inserts);
     Node<T> *new_node = new Node<T>(key);
-    new_node->right = arr[hashVal];
+    STAT(st.allocated += sizeof(Node<T>));
+    new_node->hash = h;
+    new_node->right = arr[h & mask];
 
-    arr[hashVal] = new_node;
+    arr[h & mask] = new_node;
     size++;
+    // nodes don't move when the buckets grow, so new_node is still good
+    if (size > capacity) {
+      resize();
+    }
 
     return &new_node->key;
   }
   void remove(T key) {
-    int hashVal = hash(key);
+    if (!remove_hashed(hash(key), [&](T &other) { return other == key; })) {
+      // if we didn't return, then we didn't find anything to delete
+      throw std::runtime_error("No deletion occured");
+    }
+  }
+
+  // see find_hashed. false if there was nothing to remove
+  template <typename Eq> bool remove_hashed(uint64_t h, Eq same) {
     Node<T> *prev = nullptr;
-    Node<T> *head = arr[hashVal];
+    Node<T> *head = arr[h & mask];
 
     while (head != nullptr) {
-      if (head->key == key) {
+      if (head->hash == h && same(head->key)) {
         if (prev == nullptr) {
-          arr[hashVal] = head->right;
+          arr[h & mask] = head->right;
         } else {
           prev->right = head->right;
         }
         delete head;
+        STAT(st.freed += sizeof(Node<T>); ++st.removes);
         size--;
-        return;
+        return true;
       }
       prev = head;
       head = head->right;
     }
+    return false;
+  }
+
+  // calls f on every key, in bucket order. f can change the parts of the key
+  // that don't affect hashing but must not insert or remove
+  template <typename F> void for_each(F f) {
+    for (int i = 0; i < capacity; i++) {
+      for (Node<T> *entry = arr[i]; entry != nullptr; entry = entry->right) {
+        f(entry->key);
+      }
+    }
+  }
+
+  // T has to be a pair, like for find_batch
+  MemoryUsage memory_usage() {
+    MemoryUsage u;
+    u.buckets = (long long)sizeof(Node<T> *) * capacity;
+    u.slack = allocated_size(arr) - u.buckets;
+    for (int i = 0; i < capacity; i++) {
+      for (Node<T> *entry = arr[i]; entry != nullptr; entry = entry->right) {
+        u.add_entry(entry->key, sizeof(Node<T>), allocated_size(entry));
+      }
+    }
+    return u;
+  }
 
-    // if we didn't return, then we didn't find anything to delete
-    throw std::runtime_error("No deletion occured");
+  MapStats stats() {
+    MapStats s;
+    STAT(s = st; s.counting = true);
+    s.size = size;
+    s.buckets = capacity;
+    // walking the buckets is fine here, nobody takes a snapshot in a hot loop
+    for (int i = 0; i < capacity; i++) {
+      int chain = 0;
+      for (Node<T> *entry = arr[i]; entry != nullptr; entry = entry->right) {
+        chain++;
+      }
+      if (chain > 0) {
+        s.used_buckets++;
+      }
+      s.longest_chain = std::max(s.longest_chain, chain);
+    }
+    return s;
   }
 };
 
-template <typename K, typename V> class HashMap {
+template <typename K, typename V, typename Hash = FastHash> class HashMap {
 private:
   // match on pairs
   // imp stands for implementation, for lack of a better word
-  HashTable<pair<K, V>> imp;
+  HashTable<pair<K, V>, Hash> imp;
 
 public:
   HashMap() {}
+  HashMap(int cap) : imp(cap) {}
 
   int size() { return imp.get_size(); }
   bool empty() { return imp.get_size() < 0; }
@@ -176,9 +556,145 @@ public:
   // this hack belongs in AVLMap. 0 value is ignored during find.
   // use V types default initialization (brace init for safe initialization)
   pair<K, V> *find(K k) { return imp.find({k, V{}}); }
+  // see HashTable::find_batch. Q can be a std::string_view to skip making
+  // a string per key
+  template <typename Q>
+  void find_batch(std::span<const Q> keys, std::span<pair<K, V> *> results) {
+    imp.find_batch(keys, results);
+  }
   pair<K, V> *insert(K k, V v) { return imp.insert({k, v}); }
   // hack
   void remove(K k) { imp.remove({k, V{}}); }
+
+  // f gets a pair<K, V> &, see the engine's for_each
+  template <typename F> void for_each(F f) { imp.for_each(f); }
+
+  MapStats stats() { return imp.stats(); }
+  MemoryUsage memory_usage() { return imp.memory_usage(); }
+};
+
+// every context in one model is exactly window_size chars long, so instead of
+// a std::string per key (with its own heap block once it's past 15 chars) all
+// the keys sit back to back in one array and a key is just its slot number
+class KeySlab {
+private:
+  char *data;
+  int stride;
+  uint32_t used;
+  uint32_t cap; // in keys
+
+public:
+  KeySlab(int stride) : data(nullptr), stride(stride), used(0), cap(0) {}
+  KeySlab(const KeySlab &other)
+      : data(new char[(size_t)other.cap * other.stride]), stride(other.stride),
+        used(other.used), cap(other.cap) {
+    std::memcpy(data, other.data, (size_t)used * stride);
+  }
+  KeySlab &operator=(const KeySlab &) = delete;
+  ~KeySlab() { delete[] data; }
+
+  int width() { return stride; }
+  // slots that were ever handed out, removed keys don't give theirs back
+  uint32_t count() { return used; }
+  size_t bytes() { return (size_t)cap * stride; }
+  // block the keys are in, nullptr before the first add
+  const char *block() { return data; }
+
+  // copies stride chars of key in and returns the slot they went in
+  uint32_t add(const char *key) {
+    if (used == cap) {
+      uint32_t bigger = cap == 0 ? 1024 : cap * 2;
+      char *grown = new char[(size_t)bigger * stride];
+      if (used > 0) {
+        std::memcpy(grown, data, (size_t)used * stride);
+      }
+      delete[] data;
+      data = grown;
+      cap = bigger;
+    }
+    std::memcpy(data + (size_t)used * stride, key, stride);
+    return used++;
+  }
+
+  const char *at(uint32_t slot) { return data + (size_t)slot * stride; }
+  bool equal(uint32_t slot, const char *key) {
+    return std::memcmp(at(slot), key, stride) == 0;
+  }
+};
+
+// HashMap for string keys that are all the same length, with the keys kept in
+// a KeySlab. the table only holds the 32 bit slot, so pair::first is a slot
+// number and key() turns it back into the string
+template <typename V, typename Hash = FastHash> class SlabMap {
+private:
+  KeySlab keys;
+  HashTable<pair<uint32_t, V>, Hash> imp;
+  Hash hasher;
+
+public:
+  SlabMap(int window_size) : keys(window_size) {}
+
+  int size() { return imp.get_size(); }
+  bool empty() { return imp.get_size() == 0; }
+
+  pair<uint32_t, V> *find(std::string_view k) {
+    if (k.length() != keys.width()) {
+      return nullptr;
+    }
+    return imp.find_hashed(hasher(k), [&](pair<uint32_t, V> &entry) {
+      return keys.equal(entry.first, k.data());
+    });
+  }
+  pair<uint32_t, V> *insert(std::string_view k, V v) {
+    if (k.length() != keys.width()) {
+      throw std::runtime_error("Key doesn't match the slab width");
+    }
+    pair<uint32_t, V> *f = find(k);
+    if (f != nullptr) {
+      f->second = v;
+      return f;
+    }
+    return imp.insert_hashed(hasher(k), {keys.add(k.data()), v});
+  }
+  // the key's slot in the slab isn't reused
+  void remove(std::string_view k) {
+    bool gone = k.length() == keys.width() &&
+                imp.remove_hashed(hasher(k), [&](pair<uint32_t, V> &entry) {
+                  return keys.equal(entry.first, k.data());
+                });
+    if (!gone) {
+      throw std::runtime_error("No deletion occured");
+    }
+  }
+
+  std::string_view key(const pair<uint32_t, V> &entry) {
+    return std::string_view(keys.at(entry.first), keys.width());
+  }
+
+  template <typename F> void for_each(F f) { imp.for_each(f); }
+
+  MapStats stats() { return imp.stats(); }
+  // the keys are all in the slab, slots nobody has taken yet are slack
+  MemoryUsage memory_usage() {
+    MemoryUsage u = imp.memory_usage();
+    if (keys.block() != nullptr) {
+      u.key_heap += (long long)keys.count() * keys.width();
+      u.slack += allocated_size(keys.block()) - keys.count() * keys.width();
+    }
+    return u;
+  }
+};
+
+// how generate picks each next letter
+struct Decoder {
+  enum Mode {
+    SAMPLE, // draw from the counts, like getRandom
+    GREEDY, // always the most common letter
+    TOP_K   // draw from the k most common, counts raised to 1 / temperature
+  };
+  Mode mode = SAMPLE;
+  int k = LENGTH;
+  double temperature = 1;
 };
 
 class CharDistribution {
@@ -186,6 +702,38 @@ private:
   // The problem here is 32 is the ASCII for Space, so we cannot just subtract a
   // 97. We need to account for the space somehow
   std::array<double, LENGTH> occurences{};
+  // set by freeze: the indexes of the letters that can follow, most common
+  // first. anything that changes a count makes it stale again
+  std::array<unsigned char, LENGTH> order{};
+  unsigned char successors = 0;
+  bool frozen = false;
+
+  // one generator per thread, readers of a Versioned model sample at once
+  static std::mt19937 &rng() {
+    thread_local std::random_device rd;
+    thread_local std::mt19937 gen(rd());
+    return gen;
+  }
+
+  static char letter(int i) { return i == 0 ? ' ' : (char)(i + 96); }
+
+  // puts the indexes of the nonzero counts in out, biggest count first (ties
+  // keep alphabetical order) and returns how many there are. at most 27 of
+  // them so insertion sort is plenty
+  int sort_successors(std::array<unsigned char, LENGTH> &out) {
+    int n = 0;
+    for (int i = 0; i < LENGTH; i++) {
+      if (occurences[i] == 0)
+        continue;
+      int at = n++;
+      while (at > 0 && occurences[out[at - 1]] < occurences[i]) {
+        out[at] = out[at - 1];
+        at--;
+      }
+      out[at] = i;
+    }
+    return n;
+  }
 
 public:
   CharDistribution() {}
@@ -205,6 +753,93 @@ public:
   void addLetter(char letter) {
     int y = (letter - 96) < 0 ? 0 : letter - 96;
     ++occurences[y];
+    frozen = false;
+  }
+  void addLetter(char letter, double count) {
+    int y = (letter - 96) < 0 ? 0 : letter - 96;
+    occurences[y] += count;
+    frozen = false;
+  }
+  // takes count back off, never going under 0
+  void removeLetter(char letter, double count = 1) {
+    int y = (letter - 96) < 0 ? 0 : letter - 96;
+    occurences[y] = std::max(0.0, occurences[y] - count);
+    frozen = false;
+  }
+
+  // sorts the successors once so greedy and top k don't have to look at all
+  // 27 counts every step. call it when the counts stop changing
+  void freeze() {
+    successors = sort_successors(order);
+    frozen = true;
+  }
+
+  // most common letter, '-' if there are none
+  char argmax() {
+    if (frozen) {
+      return successors > 0 ? letter(order[0]) : '-';
+    }
+    int best = -1;
+    for (int i = 0; i < LENGTH; i++) {
+      if (occurences[i] > 0 && (best < 0 || occurences[i] > occurences[best]))
+        best = i;
+    }
+    return best < 0 ? '-' : letter(best);
+  }
+
+  char next(const Decoder &how) {
+    if (how.mode == Decoder::GREEDY)
+      return argmax();
+    if (how.mode == Decoder::SAMPLE)
+      return getRandom();
+
+    // top k. use the frozen order when there is one, otherwise sort now
+    std::array<unsigned char, LENGTH> scratch;
+    const std::array<unsigned char, LENGTH> *ranked = &order;
+    int n = successors;
+    if (!frozen) {
+      n = sort_successors(scratch);
+      ranked = &scratch;
+    }
+    n = std::min(n, std::max(how.k, 1));
+    if (n == 0)
+      return '-';
+
+    double weights[LENGTH];
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+      double c = occurences[(*ranked)[i]];
+      weights[i] = how.temperature == 1 ? c : std::pow(c, 1 / how.temperature);
+      sum += weights[i];
+    }
+    std::uniform_real_distribution<> dist(0, sum);
+    double num = dist(rng());
+    for (int i = 0; i < n - 1; i++) {
+      num -= weights[i];
+      if (num < 0)
+        return letter((*ranked)[i]);
+    }
+    return letter((*ranked)[n - 1]);
+  }
+
+  // count for one letter. letters the model can't make have none
+  double count(char letter) {
+    int y = (letter - 96) < 0 ? 0 : letter - 96;
+    return y < LENGTH ? occurences[y] : 0;
+  }
+
+  double total() {
+    double sum = 0;
+    for (const auto &c : occurences) {
+      sum += c;
+    }
+    return sum;
+  }
+
+  void scale(double by) {
+    for (auto &c : occurences) {
+      c *= by;
+    }
   }
 
   char getRandom() {
@@ -212,23 +847,29 @@ public:
     for (const auto &c : occurences) {
       sum += c;
     }
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dist(1, sum);
+    // counts stop being whole numbers once they decay, so pick a real number
+    std::uniform_real_distribution<> dist(0, sum);
 
-    int num = dist(gen);
+    double num = dist(rng());
+    int last = -1;
 
     for (int i = 0; i < occurences.size(); i++) {
       if (occurences[i] == 0)
         continue;
       // for each number of occurences
+      last = i;
       num -= occurences[i];
-      if (num <= 0) {
+      if (num < 0) {
         if (i == 0)
           return ' ';
         return (char)(i + 96);
       }
     }
+    // rounding can land us here, hand back the last letter that was possible
+    if (last == 0)
+      return ' ';
+    if (last > 0)
+      return (char)(last + 96);
     // this will never happen, theoretically
     return '-';
   }
@@ -255,6 +896,507 @@ public:
   std::array<double, LENGTH> getOccurences() { return occurences; }
 };
 
+// approximate stand in for HashMap<std::string, CharDistribution> for when the
+// exact model doesn't fit in memory. the most common contexts are kept exactly
+// with space saving (a fixed number of slots, a new context kicks out the one
+// with the lowest count) and the long tail is answered from a count-min sketch
+// over (context, next char) pairs. a bloom filter of the contexts that were
+// seen at all weeds out letters that only show up because of sketch noise.
+// everything is sized up front from the budget
+class SketchModel {
+private:
+  struct Slot {
+    pair<std::string, CharDistribution> entry;
+    long long count; // times the context was seen, too high by at most err
+    long long err;
+  };
+  // rows in the sketch, a tail estimate is within the error bound with
+  // probability 1 - e^-DEPTH
+  static const int DEPTH = 4;
+  // bits set per context in the bloom filter
+  static const int PROBES = 4;
+
+  int window_size;
+  size_t budget;
+  int capacity;
+  int used;
+  long long total;
+  long long evictions;
+  Slot *slots;
+  int *heap;  // slot numbers, min heap on count
+  int *where; // where[slot] is that slot's place in heap
+  HashMap<std::string, int> index;
+  int width;
+  uint32_t *sketch; // DEPTH rows of width counters
+  size_t bits;
+  uint64_t *seen; // bloom filter of contexts
+  // find hands out a pointer to this for contexts that only live in the sketch
+  pair<std::string, CharDistribution> scratch;
+
+  // bytes one exact context costs: the slot, its heap entries, the index node
+  // and bucket, plus both copies of the key once it is too long for the small
+  // string buffer (15 chars in libstdc++)
+  static size_t slot_bytes(int window_size) {
+    size_t b = sizeof(Slot) + 2 * sizeof(int) +
+               sizeof(Node<pair<std::string, int>>) +
+               sizeof(Node<pair<std::string, int>> *);
+    if (window_size > 15) {
+      b += 2 * (window_size + 1);
+    }
+    return b;
+  }
+
+  // splitmix64 finisher
+  static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+  uint32_t &cell(uint64_t h, int c, int row) {
+    uint64_t salt = (uint64_t)(c * DEPTH + row + 1) * 0x9e3779b97f4a7c15ULL;
+    uint64_t at = mix(h + salt);
+    return sketch[(size_t)row * width + at % width];
+  }
+
+  size_t bit(uint64_t h, int probe) {
+    return mix(h + (uint64_t)(probe + 1) * 0xc2b2ae3d27d4eb4fULL) % bits;
+  }
+
+  bool maybe_seen(const std::string &ctx) {
+    uint64_t h = FastHash{}(ctx);
+    for (int p = 0; p < PROBES; p++) {
+      size_t b = bit(h, p);
+      if (!(seen[b / 64] >> (b % 64) & 1)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void swap_heap(int a, int b) {
+    std::swap(heap[a], heap[b]);
+    where[heap[a]] = a;
+    where[heap[b]] = b;
+  }
+
+  void sift_up(int i) {
+    while (i > 0 && slots[heap[i]].count < slots[heap[(i - 1) / 2]].count) {
+      swap_heap(i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+  }
+
+  void sift_down(int i) {
+    while (true) {
+      int low = i;
+      int l = 2 * i + 1, r = 2 * i + 2;
+      if (l < used && slots[heap[l]].count < slots[heap[low]].count)
+        low = l;
+      if (r < used && slots[heap[r]].count < slots[heap[low]].count)
+        low = r;
+      if (low == i)
+        return;
+      swap_heap(i, low);
+      i = low;
+    }
+  }
+
+  // plain count-min, the smallest of the counters is never below the real
+  // count. the noise this lets through gets caught by the context filter
+  long long estimate(uint64_t h, int c) {
+    uint32_t low = cell(h, c, 0);
+    for (int row = 1; row < DEPTH; row++) {
+      low = std::min(low, cell(h, c, row));
+    }
+    return low;
+  }
+
+public:
+  // half the budget goes to exact contexts, 3/8 to the sketch and the last
+  // 1/8 to the bloom filter
+  SketchModel(int window_size, size_t budget)
+      : window_size(window_size), budget(budget),
+        capacity((int)(budget / 2 / slot_bytes(window_size))), used(0),
+        total(0), evictions(0), index(std::max(capacity, 1)) {
+    width = (int)(budget / 8 * 3 / (DEPTH * sizeof(uint32_t)));
+    bits = budget / 8 / sizeof(uint64_t) * 64;
+    if (capacity < 1 || width < 2 || bits == 0) {
+      throw std::runtime_error("Memory budget too small for a sketch model");
+    }
+    slots = new Slot[capacity];
+    heap = new int[capacity];
+    where = new int[capacity];
+    sketch = new uint32_t[(size_t)DEPTH * width]();
+    seen = new uint64_t[bits / 64]();
+  }
+
+  ~SketchModel() {
+    delete[] slots;
+    delete[] heap;
+    delete[] where;
+    delete[] sketch;
+    delete[] seen;
+  }
+
+  void add(const std::string &ctx, char next) {
+    total++;
+    int c = (next - 96) < 0 ? 0 : next - 96;
+    uint64_t h = FastHash{}(ctx);
+    for (int row = 0; row < DEPTH; row++) {
+      cell(h, c, row)++;
+    }
+    for (int p = 0; p < PROBES; p++) {
+      size_t b = bit(h, p);
+      seen[b / 64] |= 1ULL << (b % 64);
+    }
+
+    pair<std::string, int> *hit = index.find(ctx);
+    if (hit != nullptr) {
+      Slot &s = slots[hit->second];
+      s.count++;
+      s.entry.second.addLetter(next);
+      sift_down(where[hit->second]);
+      return;
+    }
+
+    int slot;
+    long long floor = 0;
+    if (used < capacity) {
+      slot = used;
+      heap[used] = slot;
+      where[slot] = used;
+      used++;
+    } else {
+      // kick out the least seen context, the new one inherits its count
+      slot = heap[0];
+      floor = slots[slot].count;
+      index.remove(slots[slot].entry.first);
+      evictions++;
+    }
+    Slot &s = slots[slot];
+    s.entry.first = ctx;
+    s.entry.second = CharDistribution();
+    s.entry.second.addLetter(next);
+    s.count = floor + 1;
+    s.err = floor;
+    index.insert(ctx, slot);
+    sift_up(where[slot]);
+    sift_down(where[slot]);
+  }
+
+  // same deal as HashMap::find. a pointer into the sketch answer is only good
+  // until the next find
+  pair<std::string, CharDistribution> *find(std::string k) {
+    pair<std::string, int> *hit = index.find(k);
+    if (hit != nullptr) {
+      return &slots[hit->second].entry;
+    }
+
+    uint64_t h = FastHash{}(k);
+    scratch.first = k;
+    scratch.second = CharDistribution();
+    bool any = false;
+    std::string next = k.substr(1) + ' ';
+    for (int c = 0; c < LENGTH; c++) {
+      long long est = estimate(h, c);
+      if (est == 0) {
+        continue;
+      }
+      // if the letter really followed k then the window one over was seen too
+      next.back() = c == 0 ? ' ' : (char)(c + 96);
+      if (maybe_seen(next)) {
+        scratch.second.addLetter(next.back(), est);
+        any = true;
+      }
+    }
+    return any ? &scratch : nullptr;
+  }
+
+  void report(std::ostream &out) {
+    double eps = std::exp(1.0) / width;
+    long long min_count = used == capacity ? slots[heap[0]].count : 0;
+    size_t set = 0;
+    for (size_t i = 0; i < bits / 64; i++) {
+      set += __builtin_popcountll(seen[i]);
+    }
+    double false_hit = std::pow((double)set / bits, PROBES);
+    out << "sketch model, " << budget << " byte budget\n"
+        << "  exact contexts: " << used << " of " << capacity << " slots, "
+        << evictions << " evictions\n"
+        << "  contexts seen more than " << total / capacity
+        << " times are always exact, exact counts miss at most " << min_count
+        << " early ones\n"
+        << "  tail: " << DEPTH << " x " << width
+        << " sketch, estimates too high by at most " << eps * total
+        << " (eps " << eps << ") with probability "
+        << 1 - std::exp(-(double)DEPTH) << "\n"
+        << "  context filter: " << bits << " bits, " << false_hit
+        << " false positive rate" << std::endl;
+  }
+};
+
+// what scoring held-out text adds up to. log likelihoods are natural logs
+struct Score {
+  long long letters = 0;
+  long long unseen = 0; // letters whose context the model never saw
+  double log_likelihood = 0;
+  double seen_log_likelihood = 0; // only over letters with a known context
+
+  void add(const Score &other) {
+    letters += other.letters;
+    unseen += other.unseen;
+    log_likelihood += other.log_likelihood;
+    seen_log_likelihood += other.seen_log_likelihood;
+  }
+
+  void report(std::ostream &out) const {
+    double per = letters ? log_likelihood / letters : 0;
+    long long seen = letters - unseen;
+    double seen_per = seen ? seen_log_likelihood / seen : 0;
+    out << "scored " << letters << " letters\n"
+        << "  log likelihood per letter: " << per << " nats ("
+        << -per / std::log(2.0) << " bits)\n"
+        << "  perplexity: " << std::exp(-per) << "\n"
+        << "  unseen contexts: " << (letters ? 100.0 * unseen / letters : 0)
+        << "% of letters\n"
+        << "  perplexity over seen contexts: " << std::exp(-seen_per)
+        << std::endl;
+  }
+};
+
+// freezes every distribution in map, see CharDistribution::freeze
+template <typename Map> void freeze(Map *map) {
+  map->for_each([](auto &p) { p.second.freeze(); });
+}
+
+// keeps a model up to date while the corpus keeps growing, so nothing has to
+// be rebuilt from scratch. ingest adds the windows a new chunk makes, including
+// the ones that straddle the end of the last chunk. chunks are text that went
+// through preprocess_input already (no newlines).
+//
+// to drop old text there are two modes:
+//  - retire takes back the windows an old chunk added, so the model covers a
+//    sliding window of the text. chunks have to be retired in the order they
+//    came in, but they don't have to be cut in the same places.
+//  - decay makes every later chunk count for more than the ones before it,
+//    which is the same as old counts fading out. counts are kept scaled up and
+//    only brought back down every so often, which is also when faded out
+//    contexts get removed.
+template <typename Map> class Ingestor {
+private:
+  Map *map;
+  int window_size;
+  std::string ingested; // last window_size chars that went through ingest
+  std::string retired;  // same thing for retire
+  double weight;        // what one occurence is worth right now
+  double factor;        // how much old counts shrink per chunk, 1 is off
+  double min_weight;    // contexts fading below this get removed
+
+  // brings every count back to the scale weight 1 and drops the contexts
+  // that faded out. it's a full walk, but it only happens when weight has
+  // grown by 1 / min_weight
+  void renormalize() {
+    int dead = 0;
+    map->for_each([&](auto &p) {
+      p.second.scale(1 / weight);
+      if (p.second.total() < min_weight) {
+        dead++;
+      }
+    });
+    std::string *doomed = new std::string[dead];
+    int at = 0;
+    map->for_each([&](auto &p) {
+      if (p.second.total() < min_weight) {
+        doomed[at++] = p.first;
+      }
+    });
+    for (int i = 0; i < dead; i++) {
+      map->remove(doomed[i]);
+    }
+    delete[] doomed;
+    weight = 1;
+  }
+
+public:
+  Ingestor(Map *map, int window_size)
+      : map(map), window_size(window_size), weight(1), factor(1),
+        min_weight(1e-3) {}
+
+  // old counts get multiplied by factor (0 < factor <= 1) after every chunk
+  void set_decay(double f, double expire_below = 1e-3) {
+    if (f <= 0 || f > 1) {
+      throw std::runtime_error("Decay factor has to be in (0, 1]");
+    }
+    factor = f;
+    min_weight = expire_below;
+  }
+
+  void ingest(const std::string &chunk) {
+    std::string str = ingested + chunk;
+    for (int i = window_size; i < str.length(); i += 1) {
+      auto f = map->find(str.substr(i - window_size, window_size));
+      if (f == nullptr) {
+        CharDistribution t;
+        t.addLetter(str[i], weight);
+        map->insert(str.substr(i - window_size, window_size), t);
+      } else {
+        f->second.addLetter(str[i], weight);
+      }
+    }
+    ingested = str.substr(str.length() - std::min<size_t>(str.length(),
+                                                          window_size));
+
+    if (factor < 1) {
+      weight /= factor;
+      if (weight > 1 / min_weight) {
+        renormalize();
+      }
+    }
+  }
+
+  void retire(const std::string &chunk) {
+    if (factor < 1) {
+      throw std::runtime_error("Can't retire text while decay is on");
+    }
+    std::string str = retired + chunk;
+    for (int i = window_size; i < str.length(); i += 1) {
+      std::string window = str.substr(i - window_size, window_size);
+      auto f = map->find(window);
+      if (f == nullptr) {
+        throw std::runtime_error("Retired text was never ingested");
+      }
+      f->second.removeLetter(str[i]);
+      if (f->second.total() <= 0) {
+        map->remove(window);
+      }
+    }
+    retired = str.substr(str.length() - std::min<size_t>(str.length(),
+                                                         window_size));
+  }
+};
+
+// lets readers keep generating while one writer feeds new text into the next
+// version of the model. the writer works on its own draft, and publish() hands
+// readers a copy of it with one atomic swap. readers just grab the current
+// version and use it with no locks, and nobody ever changes it under them.
+//
+// old versions are freed with epochs: a reader notes the epoch it started in,
+// and a version that was swapped out in epoch e gets freed once no reader
+// from epoch e or earlier is still around. readers that started later can't
+// have seen it
+template <typename Map> class Versioned {
+private:
+  // how many readers can be inside at once. more than that just wait a bit
+  static const int READERS = 64;
+
+  struct Retired {
+    Map *map;
+    long long epoch;
+    Retired *next;
+  };
+
+  std::atomic<Map *> current;
+  std::atomic<long long> epoch;
+  // the epoch each reader started in, 0 for a free slot
+  std::atomic<long long> readers[READERS];
+  Retired *retired; // only the writer touches this
+  Map *draft;
+  Ingestor<Map> writer;
+
+  int enter() {
+    while (true) {
+      long long now = epoch.load();
+      for (int i = 0; i < READERS; i++) {
+        long long free_slot = 0;
+        if (readers[i].compare_exchange_strong(free_slot, now)) {
+          return i;
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  void leave(int slot) { readers[slot].store(0); }
+
+  // frees the old versions no reader can still be looking at
+  void reclaim() {
+    long long oldest = epoch.load();
+    for (int i = 0; i < READERS; i++) {
+      long long e = readers[i].load();
+      if (e != 0 && e < oldest) {
+        oldest = e;
+      }
+    }
+    Retired **at = &retired;
+    while (*at != nullptr) {
+      Retired *r = *at;
+      if (r->epoch < oldest) {
+        *at = r->next;
+        delete r->map;
+        delete r;
+      } else {
+        at = &r->next;
+      }
+    }
+  }
+
+public:
+  // keeps one version alive for as long as it's in scope
+  class Snapshot {
+  private:
+    Versioned *owner;
+    int slot;
+    Map *map;
+
+  public:
+    Snapshot(Versioned &v) : owner(&v) {
+      slot = v.enter();
+      map = v.current.load();
+    }
+    ~Snapshot() { owner->leave(slot); }
+
+    Map *get() { return map; }
+    Map *operator->() { return map; }
+  };
+
+  // takes over map, which becomes both the first version and the draft
+  Versioned(Map *map, int window_size)
+      : current(new Map(*map)), epoch(1), retired(nullptr), draft(map),
+        writer(map, window_size) {
+    for (int i = 0; i < READERS; i++) {
+      readers[i].store(0);
+    }
+  }
+
+  // there can't be any readers left when this runs
+  ~Versioned() {
+    while (retired != nullptr) {
+      Retired *r = retired;
+      retired = r->next;
+      delete r->map;
+      delete r;
+    }
+    delete current.load();
+    delete draft;
+  }
+
+  // the writer side. changes made through here only show up after publish
+  Ingestor<Map> &edit() { return writer; }
+
+  // versions are frozen before readers get them, nothing changes them after
+  void publish() {
+    Map *next = new Map(*draft);
+    freeze(next);
+    Map *old = current.exchange(next);
+    retired = new Retired{old, epoch.fetch_add(1), retired};
+    reclaim();
+  }
+};
+
 } // namespace m
 
 m::HashMap<std::string, m::CharDistribution> *read_input(std::ifstream &in,
@@ -265,17 +1407,63 @@ m::HashMap<std::string, m::CharDistribution> *read_input(std::ifstream &in,
   std::string str;
   getline(in, str);
 
+  // windows are looked up a block at a time with find_batch so the misses
+  // overlap. they're views into str so nothing gets copied to look one up
+  const int BLOCK = 64;
+  std::string_view text(str);
+  std::string_view windows[BLOCK];
+  m::pair<std::string, m::CharDistribution> *found[BLOCK];
+
+  for (int i = window_size; i < str.length(); i += BLOCK) {
+    int n = std::min<int>(BLOCK, str.length() - i);
+    for (int j = 0; j < n; j++) {
+      // go from i - window_size to i, and add the subsequent character to
+      // our entry
+      windows[j] = text.substr(i + j - window_size, window_size);
+    }
+    map->find_batch(std::span<const std::string_view>(windows, n),
+                    std::span(found, n));
+
+    for (int j = 0; j < n; j++) {
+      if (found[j] != nullptr) {
+        found[j]->second.addLetter(str[i + j]);
+        continue;
+      }
+      // missing when the batch ran, but an earlier window in this block might
+      // have added it since
+      std::string key(windows[j]);
+      auto f = map->find(key);
+      if (f == nullptr) {
+        m::CharDistribution t;
+        t.addLetter(str[i + j]);
+        map->insert(key, t);
+      } else {
+        f->second.addLetter(str[i + j]);
+      }
+    }
+  }
+  return map;
+}
+
+// read_input for windows that are too long for the small string buffer. the
+// keys go in a KeySlab, so there's no allocation per context
+m::SlabMap<m::CharDistribution> *read_input_slab(std::ifstream &in,
+                                                 int window_size) {
+  m::SlabMap<m::CharDistribution> *map =
+      new m::SlabMap<m::CharDistribution>(window_size);
+
+  std::string str;
+  getline(in, str);
+  std::string_view text(str);
+
   for (int i = window_size; i < str.length(); i += 1) {
-    // go from i - window_size to i, and add the subsequent character to our
-    // entry
-    // create the string, and the char distribution
-    auto f = map->find(str.substr(i - window_size, window_size));
+    std::string_view window = text.substr(i - window_size, window_size);
+    auto f = map->find(window);
 
     if (f == nullptr) {
       m::CharDistribution t;
       t.addLetter(str[i]);
-      map->insert(str.substr(i - window_size, window_size), t);
-
+      map->insert(window, t);
     } else {
       f->second.addLetter(str[i]);
     }
@@ -294,19 +1482,30 @@ void preprocess_input(std::ifstream &in) {
   }
 }
 
-std::string generate_output(std::ifstream &in,
-                            m::HashMap<std::string, m::CharDistribution> *map,
-                            int window_size, int output_size) {
-  in.clear();
-  in.seekg(0);
+// approximate version of read_input, memory use is fixed by budget no matter
+// how big the corpus is
+m::SketchModel *read_input_sketch(std::ifstream &in, int window_size,
+                                  size_t budget) {
+  m::SketchModel *model = new m::SketchModel(window_size, budget);
 
-  std::string line;
-  getline(in, line);
-  std::string starting_substr = line.substr(0, window_size);
+  std::string str;
+  getline(in, str);
 
+  for (int i = window_size; i < str.length(); i += 1) {
+    model->add(str.substr(i - window_size, window_size), str[i]);
+  }
+  return model;
+}
+
+// keeps adding letters to start until it's output_size long. Map is anything
+// with a find that hands back a pair with a CharDistribution in it
+template <typename Map>
+std::string generate_from(Map *map, std::string start, int window_size,
+                          int output_size,
+                          const m::Decoder &how = m::Decoder()) {
   // this is very inefficient, but no premade data structures so
   // no stringstream :(
-  std::string ret = starting_substr;
+  std::string ret = start;
 
   while (ret.size() <= output_size) {
     auto p = map->find(ret.substr(ret.size() - window_size, window_size));
@@ -314,13 +1513,475 @@ std::string generate_output(std::ifstream &in,
       std::cerr << "EARLY EXIT, NO SUBSTR FOUND HERE" << std::endl;
       return ret;
     } else {
-      ret += p->second.getRandom();
+      ret += p->second.next(how);
     }
   }
   return ret;
 }
 
-int main() {
+// looks up every window, with the map's find_batch when it has one
+template <typename Map, typename Entry>
+void find_windows(Map *map, std::span<const std::string_view> windows,
+                  std::span<Entry *> found) {
+  if constexpr (requires { map->find_batch(windows, found); }) {
+    map->find_batch(windows, found);
+  } else {
+    for (size_t i = 0; i < windows.size(); i++) {
+      found[i] = map->find(windows[i]);
+    }
+  }
+}
+
+// scores the letters of text from `from` up to `to`, each one against the
+// window_size letters before it. counts get add one smoothing so a letter the
+// context never saw doesn't make the whole thing -inf, and a context the model
+// never saw counts as every letter being equally likely
+template <typename Map>
+m::Score score_range(Map *map, std::string_view text, size_t from, size_t to,
+                     int window_size) {
+  using Entry = std::remove_pointer_t<decltype(map->find({}))>;
+  const int BLOCK = 64;
+  std::string_view windows[BLOCK];
+  Entry *found[BLOCK];
+  const double uniform = std::log(1.0 / LENGTH);
+
+  m::Score score;
+  for (size_t i = from; i < to; i += BLOCK) {
+    int n = (int)std::min<size_t>(BLOCK, to - i);
+    for (int j = 0; j < n; j++) {
+      windows[j] = text.substr(i + j - window_size, window_size);
+    }
+    find_windows(map, std::span<const std::string_view>(windows, n),
+                 std::span(found, n));
+
+    for (int j = 0; j < n; j++) {
+      if (found[j] == nullptr) {
+        score.unseen++;
+        score.log_likelihood += uniform;
+        continue;
+      }
+      m::CharDistribution &d = found[j]->second;
+      double p = std::log((d.count(text[i + j]) + 1) / (d.total() + LENGTH));
+      score.log_likelihood += p;
+      score.seen_log_likelihood += p;
+    }
+    score.letters += n;
+  }
+  return score;
+}
+
+// streams the file at path through map a chunk at a time, so it can be much
+// bigger than memory. the next chunk is read while this one is scored, split
+// between threads. each chunk starts with the last window_size letters of
+// the one before so no letter loses its context. newlines become spaces, the
+// same as preprocess_input
+template <typename Map>
+m::Score score_file(Map *map, const char *path, int window_size,
+                    int threads) {
+  const size_t CHUNK = 1 << 24;
+  std::ifstream in(path, std::ios::binary);
+  if (!in.is_open()) {
+    throw std::runtime_error("Can't open " + std::string(path));
+  }
+
+  auto fill = [&](std::string &buf, const std::string &prev) {
+    size_t keep = std::min<size_t>(window_size, prev.size());
+    buf.assign(prev, prev.size() - keep, keep);
+    buf.resize(keep + CHUNK);
+    in.read(&buf[keep], CHUNK);
+    buf.resize(keep + in.gcount());
+    std::replace(buf.begin() + keep, buf.end(), '\n', ' ');
+    return in.gcount() > 0;
+  };
+
+  std::string cur, next;
+  bool more = fill(cur, "");
+  m::Score total;
+  std::vector<m::Score> parts(threads);
+  while (more) {
+    std::thread reader([&]() { more = fill(next, cur); });
+
+    // every chunk starts window_size letters into its buffer, either because
+    // that's the carried over context or because it's the start of the file
+    size_t from = window_size, to = cur.size();
+    if (from < to) {
+      size_t step = (to - from + threads - 1) / threads;
+      std::vector<std::thread> workers;
+      for (int t = 0; t < threads; t++) {
+        size_t a = std::min(to, from + t * step);
+        size_t b = std::min(to, a + step);
+        workers.emplace_back([&, t, a, b]() {
+          parts[t] = score_range(map, cur, a, b, window_size);
+        });
+      }
+      for (int t = 0; t < threads; t++) {
+        workers[t].join();
+        total.add(parts[t]);
+      }
+    }
+
+    reader.join();
+    std::swap(cur, next);
+  }
+  return total;
+}
+
+// a model as a markov chain over its contexts, see to_chain
+struct Chain {
+  std::vector<std::string> contexts; // row and column i are contexts[i]
+  SparseMatrix transitions;
+  // chance that a step from each context picks a letter that leads to a
+  // context the model doesn't have, which is where generate stops early. 1
+  // means the context is a dead end
+  std::vector<double> lost;
+};
+
+// the chance of going from a context to the one it turns into after the next
+// letter (drop the first letter, add the new one on the end) is that letter's
+// share of the context's counts. rows are numbered in for_each order
+template <typename Map> Chain to_chain(Map *map) {
+  std::vector<std::string> contexts;
+  std::vector<m::CharDistribution *> counts;
+  m::HashMap<std::string, int> index;
+  map->for_each([&](auto &p) {
+    index.insert(p.first, (int)contexts.size());
+    contexts.push_back(p.first);
+    counts.push_back(&p.second);
+  });
+
+  const std::string_view letters = " abcdefghijklmnopqrstuvwxyz";
+  std::vector<Node> entries;
+  std::vector<double> lost(contexts.size(), 0);
+  for (size_t i = 0; i < contexts.size(); i++) {
+    double total = counts[i]->total();
+    std::string next = contexts[i].substr(1) + ' ';
+    for (char c : letters) {
+      double count = counts[i]->count(c);
+      if (count == 0) {
+        continue;
+      }
+      next.back() = c;
+      auto to = index.find(next);
+      if (to == nullptr) {
+        lost[i] += count / total;
+      } else {
+        entries.emplace_back((int)i, to->second, count / total);
+      }
+    }
+  }
+  int n = (int)contexts.size();
+  return Chain{std::move(contexts), SparseMatrix(n, n, entries),
+               std::move(lost)};
+}
+
+// prints the k most likely contexts under dist, most likely first
+void print_top(std::ostream &out, const Chain &chain,
+               const std::vector<double> &dist, int k) {
+  std::vector<int> order(dist.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = (int)i;
+  }
+  k = std::min<int>(k, order.size());
+  std::partial_sort(order.begin(), order.begin() + k, order.end(),
+                    [&](int a, int b) { return dist[a] > dist[b]; });
+  for (int i = 0; i < k; i++) {
+    out << "    " << dist[order[i]] << " \"" << chain.contexts[order[i]]
+        << "\"\n";
+  }
+}
+
+// what the chain looks like: its dead ends, where walks spend their time in
+// the long run (good seeds) and where a walk from the corpus start is after
+// steps letters
+template <typename Map>
+void report_chain(std::ostream &out, Map *map, const std::string &start,
+                  int steps, int threads) {
+  Chain chain = to_chain(map);
+  int n = chain.transitions.rows();
+  int dead = 0, leaky = 0;
+  for (double l : chain.lost) {
+    dead += l >= 1;
+    leaky += l > 0 && l < 1;
+  }
+  out << "chain over " << n << " contexts, "
+      << chain.transitions.nonzeros() << " transitions\n"
+      << "  " << dead << " dead ends, " << leaky
+      << " more contexts that sometimes lead to one\n"
+      << "  most likely contexts in the long run:\n";
+  print_top(out, chain, chain.transitions.stationary(threads), 10);
+
+  std::vector<double> from(n, 0);
+  for (int i = 0; i < n; i++) {
+    from[i] = chain.contexts[i] == start;
+  }
+  std::vector<double> after = chain.transitions.propagate(from, steps, threads);
+  double kept = 0;
+  for (double p : after) {
+    kept += p;
+  }
+  out << "  " << steps << " letters after \"" << start << "\", "
+      << 1 - kept << " of walks have hit a dead end. most likely contexts:\n";
+  print_top(out, chain, after, 5);
+  out << std::flush;
+}
+
+// starts from the beginning of the corpus
+template <typename Map>
+std::string generate_output(std::ifstream &in, Map *map, int window_size,
+                            int output_size,
+                            const m::Decoder &how = m::Decoder()) {
+  in.clear();
+  in.seekg(0);
+
+  std::string line;
+  getline(in, line);
+  return generate_from(map, line.substr(0, window_size), window_size,
+                       output_size, how);
+}
+
+// feeds the corpus in one chunk at a time on a writer thread, publishing a new
+// version after each chunk, while this thread keeps generating from whatever
+// version is out at the time
+template <typename Map>
+void run_live(std::ifstream &in, int window_size, int output_size) {
+  in.clear();
+  in.seekg(0);
+  std::string line;
+  getline(in, line);
+
+  const int chunks = 8;
+  size_t chunk = line.length() / chunks + 1;
+  m::Versioned<Map> model(new Map(), window_size);
+  std::atomic<bool> done(false);
+
+  std::thread writer([&]() {
+    for (size_t at = 0; at < line.length(); at += chunk) {
+      model.edit().ingest(line.substr(at, chunk));
+      model.publish();
+    }
+    done = true;
+  });
+
+  std::string start = line.substr(0, window_size);
+  while (!done) {
+    typename m::Versioned<Map>::Snapshot snap(model);
+    if (snap->size() > 0) {
+      std::cout << snap->size() << " contexts: "
+                << generate_from(snap.get(), start, window_size, output_size)
+                << std::endl;
+    }
+  }
+  writer.join();
+}
+
+// reads one line off fd. pending holds whatever came in past the last line,
+// so a client can send a pile of requests at once and they get picked off
+// one by one
+bool read_line(int fd, std::string &pending, std::string &line) {
+  while (true) {
+    size_t nl = pending.find('\n');
+    if (nl != std::string::npos) {
+      line = pending.substr(0, nl);
+      pending.erase(0, nl + 1);
+      return true;
+    }
+    char buf[4096];
+    ssize_t got = read(fd, buf, sizeof(buf));
+    if (got <= 0) {
+      // last line without a newline still counts
+      line = pending;
+      pending.clear();
+      return !line.empty();
+    }
+    pending.append(buf, got);
+  }
+}
+
+bool write_all(int fd, const std::string &str) {
+  size_t done = 0;
+  while (done < str.length()) {
+    ssize_t put = write(fd, str.data() + done, str.length() - done);
+    if (put <= 0) {
+      return false;
+    }
+    done += put;
+  }
+  return true;
+}
+
+// one request, one line back:
+//   gen <n> [seed]   generate until the text is n long, starting from seed
+//                    (or the start of the corpus). ok <text>
+//   greedy <n> [seed]            same, always taking the most common letter
+//   topk <k> <temp> <n> [seed]   same, sampling the k most common letters
+//                                with counts raised to 1 / temp
+//   ingest <text>    add text to the model, readers see it right after. ok
+//   quit             hang up
+// anything wrong comes back as err <reason>
+template <typename Map>
+std::string answer(m::Versioned<Map> &model, std::mutex &writing,
+                   const std::string &request, const std::string &start,
+                   int window_size) {
+  size_t sp = request.find(' ');
+  std::string cmd = request.substr(0, sp);
+  std::string rest = sp == std::string::npos ? "" : request.substr(sp + 1);
+
+  m::Decoder how;
+  if (cmd == "greedy") {
+    how.mode = m::Decoder::GREEDY;
+    cmd = "gen";
+  } else if (cmd == "topk") {
+    how.mode = m::Decoder::TOP_K;
+    try {
+      size_t used;
+      how.k = std::stoi(rest, &used);
+      rest = rest.substr(used);
+      how.temperature = std::stod(rest, &used);
+      rest = rest.substr(used);
+    } catch (const std::exception &) {
+      return "err topk needs k and a temperature";
+    }
+    if (how.temperature <= 0) {
+      return "err temperature has to be above 0";
+    }
+    rest.erase(0, rest.find_first_not_of(' '));
+    cmd = "gen";
+  }
+
+  if (cmd == "gen") {
+    sp = rest.find(' ');
+    int n;
+    try {
+      n = std::stoi(rest.substr(0, sp));
+    } catch (const std::exception &) {
+      return "err gen needs a length";
+    }
+    std::string seed = sp == std::string::npos ? start : rest.substr(sp + 1);
+    if (seed.length() < window_size) {
+      return "err seed is shorter than the window";
+    }
+    typename m::Versioned<Map>::Snapshot snap(model);
+    return "ok " + generate_from(snap.get(), seed, window_size, n, how);
+  }
+  if (cmd == "ingest") {
+    // only one writer at a time, readers never wait on this
+    std::lock_guard<std::mutex> lock(writing);
+    model.edit().ingest(rest);
+    model.publish();
+    return "ok";
+  }
+  return "err unknown request " + cmd;
+}
+
+// answers requests from in_fd on out_fd until the other end hangs up. every
+// answer is written out as soon as it's ready
+template <typename Map>
+void serve_fd(int in_fd, int out_fd, m::Versioned<Map> &model,
+              std::mutex &writing, const std::string &start,
+              int window_size) {
+  std::string pending, request;
+  while (read_line(in_fd, pending, request)) {
+    if (request == "quit") {
+      return;
+    }
+    if (request.empty()) {
+      continue;
+    }
+    std::string reply = answer(model, writing, request, start, window_size);
+    if (!write_all(out_fd, reply + "\n")) {
+      return;
+    }
+  }
+}
+
+// keeps map in memory and answers requests, from stdin or, given a path, from
+// every client of a unix socket there (one thread each)
+template <typename Map>
+void serve(Map *map, std::ifstream &in, int window_size,
+           const char *socket_path) {
+  in.clear();
+  in.seekg(0);
+  std::string line;
+  getline(in, line);
+  std::string start = line.substr(0, window_size);
+
+  m::Versioned<Map> model(map, window_size);
+  std::mutex writing;
+  // a client hanging up mid answer shouldn't take the server down
+  signal(SIGPIPE, SIG_IGN);
+
+  if (socket_path == nullptr) {
+    std::cerr << "ready" << std::endl;
+    serve_fd(STDIN_FILENO, STDOUT_FILENO, model, writing, start, window_size);
+    return;
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  unlink(socket_path);
+  if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 64) < 0) {
+    throw std::runtime_error("Can't listen on " + std::string(socket_path));
+  }
+  std::cerr << "ready on " << socket_path << std::endl;
+
+  while (true) {
+    int client = accept(listener, nullptr, nullptr);
+    if (client < 0) {
+      continue;
+    }
+    std::thread([&, client]() {
+      serve_fd(client, client, model, writing, start, window_size);
+      close(client);
+    }).detach();
+  }
+}
+
+// picks --greedy, --top-k <k> and --temperature <t> out of the arguments.
+// --temperature on its own means top k over every letter
+m::Decoder read_decoder(int argc, char **argv) {
+  m::Decoder how;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--greedy") {
+      how.mode = m::Decoder::GREEDY;
+    } else if (arg == "--top-k" && i + 1 < argc) {
+      how.mode = m::Decoder::TOP_K;
+      how.k = std::stoi(argv[++i]);
+    } else if (arg == "--temperature" && i + 1 < argc) {
+      if (how.mode == m::Decoder::SAMPLE) {
+        how.mode = m::Decoder::TOP_K;
+      }
+      how.temperature = std::stod(argv[++i]);
+    }
+  }
+  if (how.temperature <= 0) {
+    throw std::runtime_error("Temperature has to be above 0");
+  }
+  return how;
+}
+
+int main(int argc, char **argv) {
+  // --greedy, --top-k <k> and --temperature <t> change how letters are picked
+  m::Decoder how = read_decoder(argc, argv);
+  // ./a.out sketch <megabytes> runs on the approximate model instead
+  bool sketch = argc > 2 && std::string(argv[1]) == "sketch";
+  // ./a.out live keeps generating while the model is still being fed
+  bool live = argc > 1 && std::string(argv[1]) == "live";
+  // ./a.out serve <window size> [socket path] builds the model once and then
+  // answers requests, see serve
+  bool serving = argc > 2 && std::string(argv[1]) == "serve";
+  // ./a.out score <window size> <file> [threads] reports how well the model
+  // predicts the text in file, see score_file
+  bool scoring = argc > 3 && std::string(argv[1]) == "score";
+  // ./a.out memory <window size> builds the model and prints where its
+  // memory went, see MemoryUsage
+  bool measuring = argc > 2 && std::string(argv[1]) == "memory";
+  // ./a.out chain <window size> [steps] [threads] looks at the model as a
+  // markov chain, see report_chain
+  bool chaining = argc > 2 && std::string(argv[1]) == "chain";
 
   std::ifstream input;
   input.open("merchant.txt");
@@ -331,6 +1992,52 @@ int main() {
   }
   input.open("preprocessed");
 
+  if (chaining) {
+    int window_size = std::stoi(argv[2]);
+    int steps = argc > 3 ? std::stoi(argv[3]) : 100;
+    int threads = argc > 4 ? std::stoi(argv[4])
+                           : std::max(1u, std::thread::hardware_concurrency());
+    std::string line;
+    getline(input, line);
+    input.clear();
+    input.seekg(0);
+    report_chain(std::cout, read_input(input, window_size),
+                 line.substr(0, window_size), steps, threads);
+    return 0;
+  }
+
+  if (measuring) {
+    int window_size = std::stoi(argv[2]);
+    if (window_size > 15) {
+      read_input_slab(input, window_size)->memory_usage().to_json(std::cout);
+    } else {
+      read_input(input, window_size)->memory_usage().to_json(std::cout);
+    }
+    std::cout << std::endl;
+    return 0;
+  }
+
+  if (scoring) {
+    int window_size = std::stoi(argv[2]);
+    int threads = argc > 4 ? std::stoi(argv[4])
+                           : std::max(1u, std::thread::hardware_concurrency());
+    if (window_size > 15) {
+      const auto model = read_input_slab(input, window_size);
+      score_file(model, argv[3], window_size, threads).report(std::cout);
+    } else {
+      const auto model = read_input(input, window_size);
+      score_file(model, argv[3], window_size, threads).report(std::cout);
+    }
+    return 0;
+  }
+
+  if (serving) {
+    int window_size = std::stoi(argv[2]);
+    serve(read_input(input, window_size), input, window_size,
+          argc > 3 ? argv[3] : nullptr);
+    return 0;
+  }
+
   std::cout << "Welcome to Anish's bootleg RNN!" << std::endl;
   std::cout << "Please enter a window size: " << std::endl;
 
@@ -342,12 +2049,56 @@ int main() {
   int output_size;
   std::cin >> output_size;
 
+  if (live) {
+    run_live<m::HashMap<std::string, m::CharDistribution>>(input, window_size,
+                                                      output_size);
+    input.close();
+    return 0;
+  }
+
+  if (sketch) {
+    size_t budget = std::stod(argv[2]) * 1024 * 1024;
+    const auto model = read_input_sketch(input, window_size, budget);
+    std::cout << generate_output(input, model, window_size, output_size, how)
+              << std::endl;
+    model->report(std::cerr);
+    input.close();
+    return 0;
+  }
+
+  // past 15 chars every std::string key is its own allocation, so long
+  // windows keep their keys in a slab instead
+  if (window_size > 15) {
+    const auto model = read_input_slab(input, window_size);
+    if (how.mode != m::Decoder::SAMPLE) {
+      m::freeze(model);
+    }
+    std::cout << generate_output(input, model, window_size, output_size, how)
+              << std::endl;
+#ifdef MAP_STATS
+    model->stats().to_json(std::cerr);
+    std::cerr << std::endl;
+#endif
+    input.close();
+    return 0;
+  }
+
   // this returns an AVLMap
   const auto ret = read_input(input, window_size);
-  const std::string out = generate_output(input, ret, window_size, output_size);
+  // sort every context's successors once instead of on every step
+  if (how.mode != m::Decoder::SAMPLE) {
+    m::freeze(ret);
+  }
+  const std::string out =
+      generate_output(input, ret, window_size, output_size, how);
 
   std::cout << out << std::endl;
 
+#ifdef MAP_STATS
+  ret->stats().to_json(std::cerr);
+  std::cerr << std::endl;
+#endif
+
   input.close();
   return 0;
 }